@@ -8,6 +8,10 @@
 
 #include "postgres.h"
 
+#if PG_VERSION_NUM < 120000
+#error "the currency module needs PostgreSQL 12 or later"
+#endif
+
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -17,7 +21,36 @@
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "executor/spi.h"
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
 #include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "common/int.h"
+#include "nodes/nodes.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "utils/array.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
+#include "portability/instr_time.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/proc.h"
+#include "nodes/makefuncs.h"
+#include "nodes/pathnodes.h"
+#include "nodes/primnodes.h"
+#include "nodes/supportnodes.h"
+#include "optimizer/cost.h"
+#include "parser/parse_func.h"
+#include "utils/expandeddatum.h"
+#include "utils/jsonb.h"
+#include "utils/numeric.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
 
 #include "fmgr.h"
 
@@ -28,6 +61,36 @@
  * that retrieved Oid.
  */
 #include "tla.h"
+#include "rate_feed.h"
+
+void _PG_init(void);
+
+/* currency.neutral_scale; -1 for no rounding */
+static int currency_neutral_scale = -1;
+
+/* the values of a currency typmod */
+#define CANONICAL_STRIP 1
+#define CANONICAL_MINOR 2
+
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable(
+		"currency.neutral_scale",
+		"Decimal places kept when converting between currencies.",
+		"-1 keeps the full precision of the rates; "
+		"currency_rate.neutral_scale overrides it per code.",
+		&currency_neutral_scale,
+		-1,
+		-1,
+		1000,
+		PGC_SUSET,
+		0,
+		NULL, NULL, NULL
+		);
+
+	currency_rate_feed_init();
+}
 
 /*
  * This type combines int8 fixed-point numbers with a currency code,
@@ -77,6 +140,8 @@ static char *cc_pstrdup(const char *string);
 #define numeric_cmp 1769
 #define numeric_uplus 1915
 #define numeric_uminus 1771
+#define numeric_float8 1746
+#define int4_numeric 1740
 #define hash_numeric 432
 #define hashint2 449
 
@@ -105,7 +170,120 @@ cc_pstrdup(const char *string)
 	return MemoryContextStrdup(CurrencyCacheContext, string);
 }
 
-currency* make_currency(struct tv* numeric, int16 currency_code) {
+/*
+ * Expanded form, used for accumulator variables in PL/pgSQL: the
+ * flat value lives in its own memory context, and functions passed
+ * a read-write pointer to it may replace that value in place instead
+ * of building a new datum.  It only gets flattened when stored.
+ */
+#define EC_MAGIC 0x43555252	/* "CURR" */
+
+typedef struct ExpandedCurrency
+{
+	ExpandedObjectHeader hdr;
+	int ec_magic;
+	currency* value;
+	Size allocated;		/* size of the chunk at value */
+} ExpandedCurrency;
+
+static Size
+EC_get_flat_size(ExpandedObjectHeader *eohptr)
+{
+	ExpandedCurrency* ec = (ExpandedCurrency*)eohptr;
+
+	Assert(ec->ec_magic == EC_MAGIC);
+	return VARSIZE(ec->value);
+}
+
+static void
+EC_flatten_into(ExpandedObjectHeader *eohptr, void *result, Size allocated_size)
+{
+	ExpandedCurrency* ec = (ExpandedCurrency*)eohptr;
+
+	Assert(ec->ec_magic == EC_MAGIC);
+	Assert(allocated_size == VARSIZE(ec->value));
+	memcpy(result, ec->value, allocated_size);
+}
+
+static const ExpandedObjectMethods EC_methods =
+{
+	EC_get_flat_size,
+	EC_flatten_into
+};
+
+static Datum
+expand_currency(currency* value, MemoryContext parentcontext)
+{
+	MemoryContext objcxt;
+	ExpandedCurrency* ec;
+
+	objcxt = AllocSetContextCreate(
+		parentcontext,
+		"expanded currency",
+		ALLOCSET_SMALL_MINSIZE,
+		ALLOCSET_SMALL_INITSIZE,
+		ALLOCSET_SMALL_MAXSIZE
+		);
+	ec = MemoryContextAlloc(objcxt, sizeof(ExpandedCurrency));
+	EOH_init_header(&ec->hdr, &EC_methods, objcxt);
+	ec->ec_magic = EC_MAGIC;
+	ec->allocated = VARSIZE(value);
+	ec->value = MemoryContextAlloc(objcxt, ec->allocated);
+	memcpy(ec->value, value, ec->allocated);
+
+	return EOHPGetRWDatum(&ec->hdr);
+}
+
+/*
+ * replace the value held by a read-write expanded currency with a
+ * NUMERIC and code, reusing its chunk when the new value fits
+ */
+static Datum
+store_expanded_currency(Datum target, struct varlena* numeric,
+			int16 currency_code)
+{
+	ExpandedCurrency* ec = (ExpandedCurrency*)DatumGetEOHP(target);
+	Size size = VARSIZE(numeric) + offsetof(currency, numeric) - VARHDRSZ;
+
+	Assert(ec->ec_magic == EC_MAGIC);
+	if (size > ec->allocated) {
+		ec->value = repalloc(ec->value, size);
+		ec->allocated = size;
+	}
+	SET_VARSIZE(ec->value, size);
+	ec->value->currency_code = currency_code;
+	memcpy(&ec->value->numeric, VARDATA(numeric),
+	       VARSIZE(numeric) - VARHDRSZ);
+
+	return target;
+}
+
+/* fetch a currency argument, which may be toasted or expanded */
+static currency*
+DatumGetCurrency(Datum datum)
+{
+	if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(datum))) {
+		ExpandedCurrency* ec = (ExpandedCurrency*)DatumGetEOHP(datum);
+
+		Assert(ec->ec_magic == EC_MAGIC);
+		return ec->value;
+	}
+	return (currency*)PG_DETOAST_DATUM(datum);
+}
+
+#define PG_GETARG_CURRENCY(n) DatumGetCurrency(PG_GETARG_DATUM(n))
+
+/* values read out of an expanded object belong to that object */
+#define PG_FREE_CURRENCY_IF_COPY(ptr, n) \
+	do { \
+		if (!VARATT_IS_EXTERNAL_EXPANDED(PG_GETARG_POINTER(n))) \
+			PG_FREE_IF_COPY(ptr, n); \
+	} while (0)
+
+static currency* canonical_currency(currency* amount, int mode);
+int currency_native_cmp(currency* a, currency* b);
+
+currency* make_currency(struct varlena* numeric, int16 currency_code) {
 	currency* newval;
 
 	alloc_varlena(
@@ -113,7 +291,7 @@ currency* make_currency(struct tv* numeric, int16 currency_code) {
 		VARSIZE( numeric ) + offsetof(currency, numeric) - VARHDRSZ
 		);
 	memcpy( &newval->numeric,
-		DatumGetPointer( numeric ) + VARHDRSZ,
+		(char*)numeric + VARHDRSZ,
 		VARSIZE( numeric ) - VARHDRSZ );
 	newval->currency_code = currency_code;
 
@@ -143,7 +321,7 @@ char* dump_hex(void* ptr, int len)
 currency* parse_currency(char* str)
 {
 	char* number = palloc(strlen(str)+1);
-	Datum numeric_val;
+	struct varlena* numeric_val;
 	char code[4];
 	char fail[2] = "";
 	currency *newval;
@@ -157,14 +335,14 @@ currency* parse_currency(char* str)
 	code[3] = '\0';
 
 	// use numeric_in to parse the numeric
-	numeric_val = OidFunctionCall3(
+	numeric_val = (void*)OidFunctionCall3(
 		numeric_in,
 		CStringGetDatum( number ),
-		numeric,
-		-1  /* typmod */
+		ObjectIdGetDatum( numeric_oid ),
+		Int32GetDatum( -1 )  /* typmod */
 		);
-	if (!(currency_code = parse_tla(&code))) {
-		elog(ERROR, "bad currency code '%s'", &code);
+	if (!(currency_code = parse_tla(code))) {
+		elog(ERROR, "bad currency code '%s'", code);
 	}
 
 	newval = make_currency(numeric_val, currency_code);
@@ -198,7 +376,7 @@ char* emit_currency(currency* amount) {
 	 * numeric_out function and have a happy life */
 	struct varlena* tv = _currency_numeric(amount);
 
-	outstr = OidFunctionCall1( numeric_out, PointerGetDatum( tv ) );
+	outstr = DatumGetCString(OidFunctionCall1( numeric_out, PointerGetDatum( tv ) ));
 
 	pfree(tv);
 
@@ -225,9 +403,12 @@ Datum
 currency_in_cstring(PG_FUNCTION_ARGS)
 {
 	char *str = PG_GETARG_CSTRING(0);
+	int32 typmod = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : -1;
 	currency *result = parse_currency(str);
 	if (!result)
 		PG_RETURN_NULL();
+	if (typmod >= 0)
+		result = canonical_currency(result, typmod);
 
 	PG_RETURN_POINTER(result);
 }/* output function: C string */
@@ -236,14 +417,25 @@ PG_FUNCTION_INFO_V1(currency_out_cstring);
 Datum
 currency_out_cstring(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
+	currency* amount = PG_GETARG_CURRENCY(0);
 	char *result;
 	result = emit_currency(amount);
 
 	PG_RETURN_CSTRING(result);
 }
 
-static TransactionId ccc_txid = -1;
+/*
+ * the cache is keyed by local transaction id rather than xid, so that
+ * checking it never assigns an xid; that is not allowed in parallel
+ * workers
+ */
+#if PG_VERSION_NUM >= 170000
+#define CURRENT_LXID (MyProc->vxid.lxid)
+#else
+#define CURRENT_LXID (MyProc->lxid)
+#endif
+
+static LocalTransactionId ccc_lxid = InvalidLocalTransactionId;
 static CommandId ccc_cmdid = -1;
 
 typedef struct ccc_ent
@@ -252,15 +444,56 @@ typedef struct ccc_ent
 	int16 currency_minor;
 	struct varlena* currency_rate;
 	char* currency_symbol;
+	/* format template, compiled when the cache is refreshed */
+	char* fmt_prefix;	/* symbol or code, plus separating space */
+	int fmt_prefix_len;
+	char* fmt_group_sep;	/* NULL for no digit grouping */
+	int fmt_group_sep_len;
+	char* fmt_decimal_sep;
+	int fmt_decimal_sep_len;
+	bool fmt_plain;		/* no grouping, '.' for the decimal point */
+	int16 neutral_scale;	/* -1 to use currency.neutral_scale */
+	/*
+	 * the rate as an exact fraction in lowest terms; rate_den is 0 if
+	 * it has none, -1 until ccc_rate_fraction() first looks
+	 */
+	int64 rate_num;
+	int64 rate_den;
 } ccc_ent;
 
 static ccc_ent* currency_code_cache = 0;
 static int ccc_size;
+static int64 ccc_refreshes = 0;	/* for currency_bench() */
+
+/*
+ * best conversion factors between every pair of codes quoted in
+ * currency_pair_rate, found the first time a pair conversion needs
+ * them and kept, in their own memory context, until a relcache
+ * invalidation of currency_pair_rate (sent by its trigger).  For code
+ * indexes i and j (positions in ccp_codes), ccp_factor[side][i *
+ * ccp_size + j] is the numeric to multiply an amount in code i by to
+ * get code j, or NULL if there is no path.
+ *
+ * CCP_BID is the most of the target code that selling the amount
+ * would get; CCP_ASK is the least of the target code that it would
+ * cost to buy the amount.
+ */
+#define CCP_BID 0
+#define CCP_ASK 1
+
+static int ccp_size = 0;
+static int16* ccp_codes;
+static struct varlena** ccp_factor[2];
+static bool ccp_valid = false;
+static Oid ccp_relid = InvalidOid;
+static MemoryContext CurrencyPairContext = NULL;
 
-inline void update_currency_code_cache()
+int _update_cc_cache(void);
+
+static inline void update_currency_code_cache()
 {
 	if (ccc_cmdid != GetCurrentCommandId(false) ||
-	    ccc_txid != GetCurrentTransactionId()
+	    ccc_lxid != CURRENT_LXID
 		) {
 		if (!_update_cc_cache()) {
 			elog(ERROR, "failed to update currency code cache");
@@ -268,7 +501,269 @@ inline void update_currency_code_cache()
 	}
 }
 
-int _update_cc_cache() {
+/*
+ * Work out the fixed parts of format() output for a currency once,
+ * rather than on every call.
+ */
+static void
+compile_ccc_format(ccc_ent* ent, char* group_sep, char* decimal_sep)
+{
+	char* prefix;
+
+	if (ent->currency_symbol) {
+		ent->fmt_prefix_len = strlen(ent->currency_symbol) + 1;
+		prefix = cc_palloc(ent->fmt_prefix_len + 1);
+		memcpy(prefix, ent->currency_symbol, ent->fmt_prefix_len - 1);
+	}
+	else {
+		ent->fmt_prefix_len = 4;
+		prefix = cc_palloc(ent->fmt_prefix_len + 1);
+		emit_tla_buf(ent->currency_code, prefix);
+	}
+	prefix[ent->fmt_prefix_len - 1] = ' ';
+	prefix[ent->fmt_prefix_len] = '\0';
+	ent->fmt_prefix = prefix;
+
+	if (group_sep && *group_sep) {
+		ent->fmt_group_sep = cc_pstrdup(group_sep);
+		ent->fmt_group_sep_len = strlen(group_sep);
+	}
+	else {
+		ent->fmt_group_sep = 0;
+		ent->fmt_group_sep_len = 0;
+	}
+
+	ent->fmt_decimal_sep = cc_pstrdup(
+		(decimal_sep && *decimal_sep) ? decimal_sep : "."
+		);
+	ent->fmt_decimal_sep_len = strlen(ent->fmt_decimal_sep);
+
+	ent->fmt_plain = !ent->fmt_group_sep &&
+		strcmp(ent->fmt_decimal_sep, ".") == 0;
+}
+
+static struct varlena*
+ccp_numeric_copy(struct varlena* numeric)
+{
+	struct varlena* copy = MemoryContextAlloc(CurrencyPairContext,
+						  VARSIZE(numeric));
+
+	memcpy(copy, numeric, VARSIZE(numeric));
+	return copy;
+}
+
+/* relcache callback: forget the pair matrix when its table changes */
+static void
+ccp_invalidate(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == ccp_relid)
+		ccp_valid = false;
+}
+
+static int
+ccp_index(int16 currency_code)
+{
+	int max = ccp_size - 1, min = 0, i;
+
+	while (min <= max) {
+		i = (min + max) >> 1;
+		if ( ccp_codes[i] == currency_code )
+			return i;
+		else if ( ccp_codes[i] < currency_code )
+			min = i + 1;
+		else
+			max = i - 1;
+	}
+	return -1;
+}
+
+/* add a code to a sorted, unique list */
+static void
+ccp_add_code(int16* codes, int* n, int16 currency_code)
+{
+	int i;
+
+	for (i = 0; i < *n && codes[i] < currency_code; i++)
+		;
+	if (i < *n && codes[i] == currency_code)
+		return;
+	memmove(&codes[i + 1], &codes[i], sizeof(int16) * (*n - i));
+	codes[i] = currency_code;
+	(*n)++;
+}
+
+/* record a direct quote as a graph edge, if better than any other */
+static void
+ccp_set_edge(int side, int n, int from, int to, struct varlena* rate,
+	     struct varlena** edge, double* dist, int* next)
+{
+	double w = log(DatumGetFloat8(
+			       OidFunctionCall1(numeric_float8, PointerGetDatum(rate))
+			       ));
+
+	/* selling: maximise the product, buying: minimise it */
+	if (side == CCP_BID)
+		w = -w;
+	if (w < dist[from * n + to]) {
+		dist[from * n + to] = w;
+		edge[from * n + to] = rate;
+		next[from * n + to] = to;
+	}
+}
+
+/*
+ * load currency_pair_rate and find the best conversion path between
+ * every pair of codes in it, as a shortest path over log(rate).
+ */
+static void
+_update_ccp_cache(void)
+{
+	int res, i, j, k, h, n = 0, side, from, to;
+	HeapTuple tuple;
+	TupleDesc tupdesc;
+	Datum attr, one;
+	bool isnull;
+	int16* codes;
+	struct varlena *bid, *ask, *factor, *product;
+	struct varlena** edge;
+	double* dist;
+	int* next;
+
+	if (CurrencyPairContext == NULL) {
+		CurrencyPairContext = AllocSetContextCreate(
+			TopMemoryContext,
+			"CurrencyPairContext",
+			ALLOCSET_DEFAULT_MINSIZE,
+			ALLOCSET_DEFAULT_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE
+			);
+		CacheRegisterRelcacheCallback(ccp_invalidate, (Datum) 0);
+	}
+	else {
+		MemoryContextReset(CurrencyPairContext);
+	}
+	ccp_size = 0;
+
+	if (SPI_connect() == SPI_ERROR_CONNECT)
+		elog(ERROR, "failed to connect to SPI");
+	res = SPI_execute(
+		"select base, quote, bid, ask from currency_pair_rate"
+		, true
+		, 0
+		);
+	if (res != SPI_OK_SELECT) {
+		elog(ERROR, "failed to fetch currency pair rates");
+	}
+	ccp_relid = RelnameGetRelid("currency_pair_rate");
+	if (SPI_processed == 0) {
+		SPI_finish();
+		ccp_valid = true;
+		return;
+	}
+
+	tupdesc = SPI_tuptable->tupdesc;
+	codes = palloc(sizeof(int16) * SPI_processed * 2);
+	for (i = 0; i < SPI_processed; i++) {
+		tuple = SPI_tuptable->vals[i];
+		ccp_add_code(codes, &n, heap_getattr(tuple, 1, tupdesc, &isnull));
+		ccp_add_code(codes, &n, heap_getattr(tuple, 2, tupdesc, &isnull));
+	}
+	ccp_codes = MemoryContextAlloc(CurrencyPairContext, sizeof(int16) * n);
+	memcpy(ccp_codes, codes, sizeof(int16) * n);
+	ccp_size = n;
+
+	one = OidFunctionCall1(int4_numeric, Int32GetDatum(1));
+	edge = palloc(sizeof(struct varlena*) * n * n);
+	dist = palloc(sizeof(double) * n * n);
+	next = palloc(sizeof(int) * n * n);
+
+	for (side = CCP_BID; side <= CCP_ASK; side++) {
+		for (i = 0; i < n * n; i++) {
+			edge[i] = 0;
+			dist[i] = HUGE_VAL;
+			next[i] = -1;
+		}
+		for (i = 0; i < n; i++)
+			dist[i * n + i] = 0;
+
+		/* selling the base gets the bid, buying it costs the ask */
+		for (i = 0; i < SPI_processed; i++) {
+			tuple = SPI_tuptable->vals[i];
+			from = ccp_index(heap_getattr(tuple, 1, tupdesc, &isnull));
+			to = ccp_index(heap_getattr(tuple, 2, tupdesc, &isnull));
+			attr = heap_getattr(tuple, 3, tupdesc, &isnull);
+			bid = (void*)OidFunctionCall1( numeric_uplus, attr );
+			attr = heap_getattr(tuple, 4, tupdesc, &isnull);
+			ask = (void*)OidFunctionCall1( numeric_uplus, attr );
+
+			ccp_set_edge(side, n, from, to,
+				     side == CCP_BID ? bid : ask,
+				     edge, dist, next);
+			ccp_set_edge(side, n, to, from,
+				     (void*)OidFunctionCall2(
+					     numeric_div, one,
+					     PointerGetDatum(side == CCP_BID ? ask : bid)
+					     ),
+				     edge, dist, next);
+		}
+
+		/* Floyd-Warshall; the tolerance stops zero-spread quotes
+		 * from looking like cycles */
+		for (k = 0; k < n; k++)
+			for (i = 0; i < n; i++)
+				for (j = 0; j < n; j++)
+					if (dist[i * n + k] + dist[k * n + j]
+					    < dist[i * n + j] - 1e-12) {
+						dist[i * n + j] = dist[i * n + k] + dist[k * n + j];
+						next[i * n + j] = next[i * n + k];
+					}
+
+		for (i = 0; i < n; i++) {
+			if (dist[i * n + i] < 0)
+				elog(ERROR, "currency_pair_rate quotes allow an arbitrage cycle through '%s'",
+				     emit_tla( codes[i] ));
+		}
+
+		/* multiply out the rates along each best path */
+		ccp_factor[side] = MemoryContextAlloc(CurrencyPairContext,
+						      sizeof(struct varlena*) * n * n);
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < n; j++) {
+				ccp_factor[side][i * n + j] = 0;
+				if (i == j || next[i * n + j] < 0)
+					continue;
+
+				factor = 0;
+				for (k = i; k != j; k = h) {
+					h = next[k * n + j];
+					if (factor) {
+						product = (void*)OidFunctionCall2(
+							numeric_mul,
+							PointerGetDatum(factor),
+							PointerGetDatum(edge[k * n + h])
+							);
+						factor = product;
+					}
+					else {
+						factor = edge[k * n + h];
+					}
+				}
+				ccp_factor[side][i * n + j] = ccp_numeric_copy(factor);
+			}
+		}
+	}
+
+	SPI_finish();
+	ccp_valid = true;
+}
+
+static inline void update_currency_pair_cache(void)
+{
+	if (!ccp_valid)
+		_update_ccp_cache();
+}
+
+int _update_cc_cache(void) {
 	int res, i;
 	HeapTuple tuple;
 	TupleDesc tupdesc;
@@ -276,7 +771,8 @@ int _update_cc_cache() {
 	Oid typoutput_sym;
 	bool junk, isnull;
 	char* outputstr;
-	struct tv *numeric;
+	char *group_sep, *decimal_sep;
+	struct varlena *numeric;
 
 	if (SPI_connect() == SPI_ERROR_CONNECT) {
 		elog(ERROR, "failed to connect to SPI");
@@ -284,7 +780,8 @@ int _update_cc_cache() {
 	}
 	res = SPI_execute(
 		"select"
-		" code, minor, rate, symbol, is_exchange"
+		" code, minor, rate, symbol, is_exchange,"
+		" group_sep, decimal_sep, neutral_scale"
 		" from currency_rate"
 		" order by is_exchange desc, code"
 		, true
@@ -314,7 +811,7 @@ int _update_cc_cache() {
 	/* results are in SPI_tuptable */
 	tupdesc = SPI_tuptable->tupdesc;
 	getTypeOutputInfo(
-		tupdesc->attrs[3]->atttypid,
+		TupleDescAttr(tupdesc, 3)->atttypid,
 		&typoutput_sym, &junk
 		);
 
@@ -337,15 +834,28 @@ int _update_cc_cache() {
 			outputstr = OidOutputFunctionCall(typoutput_sym, attr);
 			currency_code_cache[i].currency_symbol = cc_pstrdup(outputstr);
 		}
-		
+
+		/* separators; same type as symbol */
+		attr = heap_getattr(tuple, 6, tupdesc, &isnull);
+		group_sep = isnull ? 0 : OidOutputFunctionCall(typoutput_sym, attr);
+		attr = heap_getattr(tuple, 7, tupdesc, &isnull);
+		decimal_sep = isnull ? 0 : OidOutputFunctionCall(typoutput_sym, attr);
+		compile_ccc_format(&currency_code_cache[i], group_sep, decimal_sep);
+
+		/* neutral_scale */
+		attr = heap_getattr(tuple, 8, tupdesc, &isnull);
+		currency_code_cache[i].neutral_scale =
+			isnull ? -1 : DatumGetInt16(attr);
+
 		/* rate */
 		attr = heap_getattr(tuple, 3, tupdesc, &isnull);
 		/* this seems to help */
-		numeric = OidFunctionCall1( numeric_uplus, attr );
+		numeric = (void*)OidFunctionCall1( numeric_uplus, attr );
 		currency_code_cache[i].currency_rate = cc_palloc( VARSIZE(numeric) );
 		memcpy(currency_code_cache[i].currency_rate,
 		       numeric,
 		       VARSIZE(numeric));
+		currency_code_cache[i].rate_den = -1;
 
 		/* is_exchange */
 		attr = heap_getattr(tuple, 5, tupdesc, &isnull);
@@ -361,7 +871,8 @@ int _update_cc_cache() {
 	SPI_finish();
 
 	ccc_cmdid = GetCurrentCommandId(false);
-	ccc_txid = GetCurrentTransactionId();
+	ccc_lxid = CURRENT_LXID;
+	ccc_refreshes++;
 	return ccc_size;
 }
 
@@ -391,14 +902,184 @@ ccc_ent* lookup_currency_code(int16 currency_code) {
 	return 0;
 }
 
+/*
+ * Canonical forms for stored amounts, so that equal amounts in a
+ * code have the same bytes: CANONICAL_STRIP drops trailing zeros
+ * after the decimal point, CANONICAL_MINOR rounds (half away from
+ * zero) or pads to the code's minor unit.  Chosen per column with
+ * currency(strip) or currency(minor).  Returns NULL if the numeric
+ * is unchanged.
+ */
+static struct varlena*
+canonical_numeric(struct varlena* numeric, int16 currency_code, int mode)
+{
+	char *str, *point, *x;
+	struct varlena* result = NULL;
+	ccc_ent* ent;
+
+	if (mode == CANONICAL_STRIP) {
+		str = (char*)OidFunctionCall1( numeric_out, PointerGetDatum( numeric ) );
+		point = strchr(str, '.');
+		if (point) {
+			x = str + strlen(str);
+			while (x[-1] == '0')
+				x--;
+			if (x[-1] == '.')
+				x--;
+			*x = '\0';
+			result = (void*)OidFunctionCall3(
+				numeric_in,
+				CStringGetDatum( str ),
+				ObjectIdGetDatum( numeric_oid ),
+				Int32GetDatum( -1 )
+				);
+		}
+		pfree(str);
+	}
+	else if (mode == CANONICAL_MINOR) {
+		update_currency_code_cache();
+		ent = lookup_currency_code(currency_code);
+		if (!ent)
+			elog(ERROR, "currency code '%s' not in currency_rate table",
+			     emit_tla( currency_code ));
+		result = (void*)OidFunctionCall2(
+			numeric_round_scale,
+			PointerGetDatum( numeric ),
+			Int32GetDatum( ent->currency_minor )
+			);
+	}
+	return result;
+}
+
+static currency*
+canonical_currency(currency* amount, int mode)
+{
+	struct varlena* numeric = _currency_numeric(amount);
+	struct varlena* canon = canonical_numeric(numeric, amount->currency_code, mode);
+	currency* result = amount;
+
+	if (canon) {
+		result = make_currency((void*)canon, amount->currency_code);
+		pfree(canon);
+	}
+	pfree(numeric);
+	return result;
+}
+
+/* typmod: currency(strip) or currency(minor) */
+PG_FUNCTION_INFO_V1(currency_typmod_in);
+Datum
+currency_typmod_in(PG_FUNCTION_ARGS)
+{
+	ArrayType* ta = PG_GETARG_ARRAYTYPE_P(0);
+	Datum* elems;
+	int n;
+	char* mod;
+
+	deconstruct_array(ta, CSTRINGOID, -2, false, 'c', &elems, NULL, &n);
+	if (n != 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid type modifier for currency"),
+			 errhint("Use currency(strip) or currency(minor).")
+				));
+	mod = DatumGetCString(elems[0]);
+	if (pg_strcasecmp(mod, "strip") == 0)
+		PG_RETURN_INT32(CANONICAL_STRIP);
+	if (pg_strcasecmp(mod, "minor") == 0)
+		PG_RETURN_INT32(CANONICAL_MINOR);
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("invalid type modifier \"%s\" for currency", mod),
+		 errhint("Use currency(strip) or currency(minor).")
+			));
+	PG_RETURN_INT32(-1);
+}
+
+PG_FUNCTION_INFO_V1(currency_typmod_out);
+Datum
+currency_typmod_out(PG_FUNCTION_ARGS)
+{
+	int32 typmod = PG_GETARG_INT32(0);
+
+	PG_RETURN_CSTRING(pstrdup(
+		typmod == CANONICAL_STRIP ? "(strip)" :
+		typmod == CANONICAL_MINOR ? "(minor)" : ""
+		));
+}
+
+/* length coercion cast to a column's typmod */
+PG_FUNCTION_INFO_V1(currency_apply_typmod);
+Datum
+currency_apply_typmod(PG_FUNCTION_ARGS)
+{
+	currency* amount = PG_GETARG_CURRENCY(0);
+	int32 typmod = PG_GETARG_INT32(1);
+
+	if (typmod < 0)
+		PG_RETURN_POINTER(amount);
+	PG_RETURN_POINTER(canonical_currency(amount, typmod));
+}
+
+/* apply a compiled format template to the output of numeric_out */
+static text*
+apply_ccc_format(ccc_ent* info, char* number)
+{
+	text* result;
+	char *digits, *point, *x, *n;
+	int number_len = strlen(number);
+	int int_len, ngroups, size;
+
+	if (info->fmt_plain) {
+		size = VARHDRSZ + info->fmt_prefix_len + number_len;
+		alloc_varlena(result, size);
+		x = VARDATA(result);
+		memcpy(x, info->fmt_prefix, info->fmt_prefix_len);
+		memcpy(x + info->fmt_prefix_len, number, number_len);
+		return result;
+	}
+
+	digits = (*number == '-') ? number + 1 : number;
+	point = strchr(digits, '.');
+	int_len = point ? point - digits : strlen(digits);
+	ngroups = (info->fmt_group_sep && int_len > 0) ? (int_len - 1) / 3 : 0;
+
+	size = VARHDRSZ + info->fmt_prefix_len + number_len
+		+ ngroups * info->fmt_group_sep_len
+		+ (point ? info->fmt_decimal_sep_len - 1 : 0);
+	alloc_varlena(result, size);
+	x = VARDATA(result);
+
+	memcpy(x, info->fmt_prefix, info->fmt_prefix_len);
+	x += info->fmt_prefix_len;
+	if (digits != number)
+		*x++ = '-';
+
+	for (n = digits; n < digits + int_len; n++) {
+		*x++ = *n;
+		if (ngroups && (digits + int_len - n - 1) % 3 == 0
+		    && n < digits + int_len - 1) {
+			memcpy(x, info->fmt_group_sep, info->fmt_group_sep_len);
+			x += info->fmt_group_sep_len;
+		}
+	}
+	if (point) {
+		memcpy(x, info->fmt_decimal_sep, info->fmt_decimal_sep_len);
+		x += info->fmt_decimal_sep_len;
+		n = point + 1;
+		memcpy(x, n, number + number_len - n);
+	}
+
+	return result;
+}
+
 PG_FUNCTION_INFO_V1(currency_format);
 Datum
 currency_format(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
-	char *result;
+	currency* amount = PG_GETARG_CURRENCY(0);
+	text *result;
 	char *number;
-	char *x;
 	ccc_ent *info;
 	struct varlena* numeric;
 	struct varlena* rounded;
@@ -410,29 +1091,44 @@ currency_format(PG_FUNCTION_ARGS)
 		     emit_tla( amount->currency_code ));
 
 	numeric = _currency_numeric(amount);
-	rounded = OidFunctionCall2(
+	rounded = (void*)OidFunctionCall2(
 		numeric_round_scale, PointerGetDatum( numeric ),
-		info->currency_minor
+		Int32GetDatum( info->currency_minor )
 		);
-	number = OidFunctionCall1( numeric_out, PointerGetDatum( rounded ) );
+	number = DatumGetCString(OidFunctionCall1( numeric_out, PointerGetDatum( rounded ) ));
 	pfree(numeric);
 	pfree(rounded);
 
-	if (info->currency_symbol) {
-		result = palloc( strlen(info->currency_symbol) + strlen(number) + 2 );
-		strcpy( result, info->currency_symbol );
-		x = result + strlen(result);
-	}
-	else {
-		result = palloc( strlen(number) + 5 );
-		emit_tla_buf( info->currency_code, result );
-		x = result + 3;
-	}
-	*x++ = ' ';
-	strcpy(x, number);
+	result = apply_ccc_format(info, number);
 	pfree(number);
 
-	PG_RETURN_CSTRING(result);
+	PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * Round a numeric that came out of a conversion to the working scale
+ * for a code (ent may be NULL for a code not in currency_rate), so
+ * that repeated conversions and mixed-code sums do not keep growing
+ * the scale.  Rounds half away from zero, like round(numeric, int).
+ * Frees the input if it rounds.
+ */
+static struct varlena*
+round_working_scale(struct varlena* numeric, ccc_ent* ent)
+{
+	int scale = (ent && ent->neutral_scale >= 0)
+		? ent->neutral_scale : currency_neutral_scale;
+	struct varlena* rounded;
+
+	if (scale < 0)
+		return numeric;
+
+	rounded = (void*)OidFunctionCall2(
+		numeric_round_scale,
+		PointerGetDatum( numeric ),
+		Int32GetDatum( scale )
+		);
+	pfree(numeric);
+	return rounded;
 }
 
 /* convert a currency to a neutral NUMERIC value */
@@ -450,14 +1146,14 @@ struct varlena* currency_neutral(currency* amount) {
 		return amount_num;
 	}
 	else {
-		neutral = OidFunctionCall2(
+		neutral = (void*)OidFunctionCall2(
 			numeric_mul,
-			_currency_numeric(amount),
+			PointerGetDatum(amount_num),
 			PointerGetDatum(cc_info->currency_rate)
 			);
 		pfree(amount_num);
 
-		return neutral;
+		return round_working_scale(neutral, cc_info);
 	}
 }
 
@@ -465,7 +1161,7 @@ PG_FUNCTION_INFO_V1(currency_convert);
 Datum
 currency_convert(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
+	currency* amount = PG_GETARG_CURRENCY(0);
 	int16 target_code = PG_GETARG_DATUM(1);
 
 	struct varlena* neutral;
@@ -485,26 +1181,118 @@ currency_convert(PG_FUNCTION_ARGS)
 		target = neutral;
 	}
 	else {
-		target = OidFunctionCall2(
+		target = (void*)OidFunctionCall2(
 			numeric_div,
 			PointerGetDatum(neutral),
 			PointerGetDatum(cc_to->currency_rate)
 			);
 		pfree(neutral);
+		target = round_working_scale(target, cc_to);
+	}
+
+	newval = make_currency(target, target_code);
+
+	pfree(target);
+	PG_RETURN_POINTER(newval);
+
+}
+
+/* convert between codes at the best rate in currency_pair_rate */
+static currency*
+currency_convert_pair(currency* amount, int16 target_code, int side)
+{
+	struct varlena *amount_num, *target;
+	struct varlena* factor = 0;
+	int from, to;
+	currency* newval;
+
+	amount_num = _currency_numeric(amount);
+	if (amount->currency_code == target_code) {
+		newval = make_currency(amount_num, target_code);
+		pfree(amount_num);
+		return newval;
 	}
 
+	update_currency_pair_cache();
+	from = ccp_index(amount->currency_code);
+	to = ccp_index(target_code);
+	if (from >= 0 && to >= 0)
+		factor = ccp_factor[side][from * ccp_size + to];
+	if (!factor)
+		elog(ERROR, "no conversion from '%s' to '%s' in currency_pair_rate",
+		     emit_tla( amount->currency_code ), emit_tla( target_code ));
+
+	target = (void*)OidFunctionCall2(
+		numeric_mul,
+		PointerGetDatum(amount_num),
+		PointerGetDatum(factor)
+		);
+	target = round_working_scale(target, lookup_currency_code(target_code));
 	newval = make_currency(target, target_code);
 
+	pfree(amount_num);
 	pfree(target);
 	return newval;
+}
+
+static int
+parse_ccp_side(text* side)
+{
+	char* str = text_to_cstring(side);
+	int rv = CCP_BID;
+
+	if (pg_strcasecmp(str, "bid") == 0)
+		rv = CCP_BID;
+	else if (pg_strcasecmp(str, "ask") == 0)
+		rv = CCP_ASK;
+	else
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid side \"%s\": must be \"bid\" or \"ask\"", str)
+				));
+	pfree(str);
+	return rv;
+}
+
+PG_FUNCTION_INFO_V1(currency_convert_side);
+Datum
+currency_convert_side(PG_FUNCTION_ARGS)
+{
+	currency* amount = PG_GETARG_CURRENCY(0);
+	int16 target_code = PG_GETARG_DATUM(1);
+	int side = parse_ccp_side(PG_GETARG_TEXT_PP(2));
+
+	update_currency_code_cache();
+	PG_RETURN_POINTER(currency_convert_pair(amount, target_code, side));
+}
+
+/* compare two values, converting the second to the code of the first
+ * at the given side of the pair rates */
+PG_FUNCTION_INFO_V1(currency_cmp_side);
+Datum
+currency_cmp_side(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int side = parse_ccp_side(PG_GETARG_TEXT_PP(2));
+	currency* b_conv;
+	int diff;
+
+	update_currency_code_cache();
+	b_conv = currency_convert_pair(b, a->currency_code, side);
+	diff = currency_native_cmp(a, b_conv);
+	pfree(b_conv);
 
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_INT32(diff);
 }
 
 PG_FUNCTION_INFO_V1(currency_code);
 Datum
 currency_code(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
+	currency* amount = PG_GETARG_CURRENCY(0);
 	int16 currency_code = amount->currency_code;
 
 	PG_RETURN_DATUM(currency_code);
@@ -514,7 +1302,7 @@ PG_FUNCTION_INFO_V1(currency_value);
 Datum
 currency_value(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
+	currency* amount = PG_GETARG_CURRENCY(0);
 
 	PG_RETURN_POINTER(_currency_numeric(amount));
 }
@@ -523,63 +1311,50 @@ PG_FUNCTION_INFO_V1(currency_compose);
 Datum
 currency_compose(PG_FUNCTION_ARGS)
 {
-	struct tv* number = PG_GETARG_POINTER(0);
+	struct varlena* number = PG_GETARG_VARLENA_P(0);
 	int16 currency_code = PG_GETARG_DATUM(1);
 	currency* newval;
 
 	PG_RETURN_POINTER( make_currency( number, currency_code ));
 }
 
-#if PG_VERSION_NUM >= 90100
 #define numeric_cash 3824
-#else
-#define cash_in 886
-#endif
 
 PG_FUNCTION_INFO_V1(currency_money);
 Datum
 currency_money(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
+	currency* amount = PG_GETARG_CURRENCY(0);
 	int16 target_code;
-	struct tv* neutral;
+	struct varlena* neutral;
 	ccc_ent* cc_from;
-#ifndef numeric_cash
-	char* outstr;
-#endif
 
 	update_currency_code_cache();
 
 	neutral = currency_neutral(amount);
 
-#ifdef numeric_cash
-	PG_RETURN_POINTER( OidFunctionCall1( numeric_cash, neutral ) );
-#else
-	// else go through a C string, of course :)
-	outstr = OidFunctionCall1( numeric_out, PointerGetDatum( neutral ) );
-	PG_RETURN_POINTER( OidFunctionCall1( cash_in, CStringGetDatum(outstr) ) );
-#endif
+	PG_RETURN_DATUM( OidFunctionCall1( numeric_cash, PointerGetDatum( neutral ) ) );
 }
 
 PG_FUNCTION_INFO_V1(currency_numeric);
 Datum
 currency_numeric(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
+	currency* amount = PG_GETARG_CURRENCY(0);
 	int16 target_code;
-	struct tv *neutral, *rounded;
+	struct varlena *neutral, *rounded;
 	ccc_ent* neutral_info;
 
 	update_currency_code_cache();
 	neutral_info = currency_code_cache;
 
 	neutral = currency_neutral(amount);
-	rounded = OidFunctionCall2(
+	rounded = (void*)OidFunctionCall2(
 		numeric_round_scale, PointerGetDatum( neutral ),
-		neutral_info->currency_minor
+		Int32GetDatum( neutral_info->currency_minor )
 		);
 	pfree(neutral);
-	PG_FREE_IF_COPY(amount, 0);
+	PG_FREE_CURRENCY_IF_COPY(amount, 0);
 
 	PG_RETURN_POINTER( rounded );
 }
@@ -589,7 +1364,7 @@ currency_numeric(PG_FUNCTION_ARGS)
 int currency_cmp(currency* a, currency* b)
 {
 	int rv;
-	struct tv *a_n, *b_n;
+	struct varlena *a_n, *b_n;
 	if (a->currency_code == b->currency_code) {
 		a_n = _currency_numeric(a);
 		b_n = _currency_numeric(b);
@@ -608,42 +1383,151 @@ int currency_cmp(currency* a, currency* b)
 	return rv;
 }
 
-PG_FUNCTION_INFO_V1(currency_eq);
-Datum
-currency_eq(PG_FUNCTION_ARGS)
-{
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
-	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
-	PG_RETURN_BOOL(diff == 0);
-}
+/*
+ * Per-call-site memo of neutral values, kept in fn_extra: sorts,
+ * merge joins and hash probes compare or hash the same values many
+ * times.  A small LRU keyed by the raw value; it is emptied when the
+ * rates cache is reloaded or currency.neutral_scale changes.
+ */
+#define NEUTRAL_MEMO_SIZE 16
 
-PG_FUNCTION_INFO_V1(currency_ne);
-Datum
-currency_ne(PG_FUNCTION_ARGS)
+typedef struct neutral_memo_ent
 {
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
-	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
-	PG_RETURN_BOOL(diff != 0);
-}
+	currency* key;		/* NULL if the slot is unused */
+	struct varlena* neutral;
+	bool has_hash;
+	int32 hash;		/* hash_numeric of neutral */
+	uint32 last_used;
+} neutral_memo_ent;
 
-PG_FUNCTION_INFO_V1(currency_le);
+typedef struct neutral_memo
+{
+	int64 refreshes;	/* ccc_refreshes when filled */
+	int neutral_scale;	/* currency.neutral_scale when filled */
+	uint32 clock;
+	neutral_memo_ent ents[NEUTRAL_MEMO_SIZE];
+} neutral_memo;
+
+/* caller is expected to have called update_currency_code_cache() */
+static neutral_memo_ent*
+neutral_memo_lookup(FmgrInfo* flinfo, currency* amount)
+{
+	neutral_memo* memo = flinfo->fn_extra;
+	neutral_memo_ent *ent, *victim;
+	struct varlena* neutral;
+	Size size = VARSIZE(amount);
+	int i;
+
+	if (!memo) {
+		memo = MemoryContextAllocZero(flinfo->fn_mcxt, sizeof(neutral_memo));
+		memo->refreshes = ccc_refreshes;
+		memo->neutral_scale = currency_neutral_scale;
+		flinfo->fn_extra = memo;
+	}
+	else if (memo->refreshes != ccc_refreshes ||
+		 memo->neutral_scale != currency_neutral_scale) {
+		for (i = 0; i < NEUTRAL_MEMO_SIZE; i++) {
+			ent = &memo->ents[i];
+			if (ent->key) {
+				pfree(ent->key);
+				pfree(ent->neutral);
+				ent->key = NULL;
+			}
+		}
+		memo->refreshes = ccc_refreshes;
+		memo->neutral_scale = currency_neutral_scale;
+	}
+
+	victim = &memo->ents[0];
+	for (i = 0; i < NEUTRAL_MEMO_SIZE; i++) {
+		ent = &memo->ents[i];
+		if (ent->key && VARSIZE(ent->key) == size &&
+		    memcmp(ent->key, amount, size) == 0) {
+			ent->last_used = ++memo->clock;
+			return ent;
+		}
+		/* prefer an unused slot, then the least recently used */
+		if (victim->key &&
+		    (!ent->key || ent->last_used < victim->last_used))
+			victim = ent;
+	}
+
+	neutral = currency_neutral(amount);
+	if (victim->key) {
+		pfree(victim->key);
+		pfree(victim->neutral);
+	}
+	victim->key = MemoryContextAlloc(flinfo->fn_mcxt, size);
+	memcpy(victim->key, amount, size);
+	victim->neutral = MemoryContextAlloc(flinfo->fn_mcxt, VARSIZE(neutral));
+	memcpy(victim->neutral, neutral, VARSIZE(neutral));
+	victim->has_hash = false;
+	victim->last_used = ++memo->clock;
+	pfree(neutral);
+
+	return victim;
+}
+
+/* currency_cmp(), through the memo when there is a call site */
+static int
+currency_cmp_memo(FmgrInfo* flinfo, currency* a, currency* b)
+{
+	neutral_memo_ent *a_ent, *b_ent;
+
+	if (!flinfo || a->currency_code == b->currency_code)
+		return currency_cmp(a, b);
+
+	a_ent = neutral_memo_lookup(flinfo, a);
+	b_ent = neutral_memo_lookup(flinfo, b);
+	return DatumGetInt32(OidFunctionCall2(
+		numeric_cmp,
+		PointerGetDatum( a_ent->neutral ),
+		PointerGetDatum( b_ent->neutral )
+		));
+}
+
+PG_FUNCTION_INFO_V1(currency_eq);
+Datum
+currency_eq(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
+	update_currency_code_cache();
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff == 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_ne);
+Datum
+currency_ne(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
+	update_currency_code_cache();
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff != 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_le);
 Datum
 currency_le(PG_FUNCTION_ARGS)
 {
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
 	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
 	PG_RETURN_BOOL(diff <= 0);
 }
 
@@ -651,12 +1535,14 @@ PG_FUNCTION_INFO_V1(currency_lt);
 Datum
 currency_lt(PG_FUNCTION_ARGS)
 {
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
 	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
 	PG_RETURN_BOOL(diff < 0);
 }
 
@@ -664,12 +1550,14 @@ PG_FUNCTION_INFO_V1(currency_ge);
 Datum
 currency_ge(PG_FUNCTION_ARGS)
 {
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
 	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
 	PG_RETURN_BOOL(diff >= 0);
 }
 
@@ -677,12 +1565,14 @@ PG_FUNCTION_INFO_V1(currency_gt);
 Datum
 currency_gt(PG_FUNCTION_ARGS)
 {
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
 	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
 	PG_RETURN_BOOL(diff > 0);
 }
 
@@ -690,51 +1580,603 @@ PG_FUNCTION_INFO_V1(currency_btcmp);
 Datum
 currency_btcmp(PG_FUNCTION_ARGS)
 {
-	currency* a = (void*)PG_GETARG_POINTER(0);
-	currency* b = (void*)PG_GETARG_POINTER(1);
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff;
+
+	update_currency_code_cache();
+	diff = currency_cmp_memo(fcinfo->flinfo, a, b);
+
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_INT32(diff);
+}
+
+/*
+ * Planner support for the neutral comparisons.  When one side is a
+ * column leading a btree index on code() of it and the other a
+ * constant, "price > '100 USD'" is rewritten at plan time, using the
+ * cached rates, into
+ *
+ *   ((code(price) = 'EUR' AND value(price) >= t_EUR) OR ...
+ *    OR (code(price) #># 'EUR' AND code(price) #<# 'GBP') OR ...)
+ *   AND price > '100 USD'
+ *
+ * with one branch for each code in currency_rate with a positive
+ * rate, so that a (code(price), value(price)) btree index can be
+ * used.  The remaining branches cover the ranges of codes between
+ * those, so amounts in unknown codes still reach the original
+ * comparison and fail there as before.  Small tables, and sessions
+ * with index and bitmap scans disabled, are left alone.  The
+ * thresholds for codes other than the constant's are widened by one
+ * unit of the exchange currency, to allow for currency.neutral_scale
+ * rounding, and then rounded outwards to the code's minor unit; the
+ * original comparison is kept to recheck them.
+ *
+ * The plan then depends on the rates, so currency_rate is added to
+ * the relations it depends on, and the currency_rate_changed trigger
+ * invalidates such plans when the rates change.
+ */
+typedef enum
+{
+	CMP_EQ,
+	CMP_LT,
+	CMP_LE,
+	CMP_GT,
+	CMP_GE
+} cmp_kind;
+
+/* names of the SQL functions, and of their operators */
+static const char* const cmp_funcname[] = { "eq", "lt", "le", "gt", "ge" };
+static const char* const cmp_opname[] = { "=", "<", "<=", ">", ">=" };
+static const cmp_kind cmp_commute[] = { CMP_EQ, CMP_GT, CMP_GE, CMP_LT, CMP_LE };
+
+static List*
+qualified_name(char* nspname, const char* name)
+{
+	return list_make2(makeString(nspname), makeString(pstrdup(name)));
+}
+
+/*
+ * whether the rewrite can pay off: index or bitmap scans are enabled,
+ * the relation is a table or materialized view of more than one block
+ * or a partitioned table, and there is a valid, non-partial btree
+ * index whose leading key is code(column).  A partitioned table has
+ * no blocks of its own, and its index list holds the partitioned
+ * indexes, which every partition has a copy of.
+ */
+static bool
+has_code_index(Oid relid, AttrNumber attno, Oid code_fn)
+{
+	Relation rel;
+	List* indexes;
+	ListCell* lc;
+	bool found = false;
+
+	if (!enable_indexscan && !enable_bitmapscan)
+		return false;
+
+	rel = table_open(relid, NoLock);
+	switch (rel->rd_rel->relkind) {
+	case RELKIND_RELATION:
+	case RELKIND_MATVIEW:
+		if (RelationGetNumberOfBlocks(rel) > 1)
+			break;
+		table_close(rel, NoLock);
+		return false;
+	case RELKIND_PARTITIONED_TABLE:
+		break;
+	default:
+		/* foreign tables and the like have no indexes to use */
+		table_close(rel, NoLock);
+		return false;
+	}
+	indexes = RelationGetIndexList(rel);
+
+	foreach(lc, indexes) {
+		Relation index = index_open(lfirst_oid(lc), AccessShareLock);
+		Form_pg_index form = index->rd_index;
+
+		if (form->indisvalid &&
+		    index->rd_rel->relam == BTREE_AM_OID &&
+		    form->indkey.values[0] == 0 &&
+		    RelationGetIndexPredicate(index) == NIL) {
+			FuncExpr* f = linitial(RelationGetIndexExpressions(index));
+			Var* v;
+
+			if (IsA(f, FuncExpr) && f->funcid == code_fn) {
+				v = linitial(f->args);
+				if (IsA(v, Var) && v->varattno == attno)
+					found = true;
+			}
+		}
+		index_close(index, AccessShareLock);
+		if (found)
+			break;
+	}
+	list_free(indexes);
+	table_close(rel, NoLock);
+	return found;
+}
+
+static int
+cmp_int16(const void* a, const void* b)
+{
+	return *(const int16*)a - *(const int16*)b;
+}
+
+static Const*
+make_numeric_const(struct varlena* numeric)
+{
+	return makeConst(numeric_oid, -1, InvalidOid, -1,
+			 PointerGetDatum(numeric), false, false);
+}
+
+/*
+ * (neutral + slack) / rate, rounded outwards to the minor unit: down
+ * and one unit lower when slack is negative, up and one unit higher
+ * otherwise.  The neutral value is padded to 20 places first so the
+ * division is exact well past the minor unit.
+ */
+static struct varlena*
+neutral_bound(struct varlena* neutral, int slack, ccc_ent* ent)
+{
+	char unit[16];
+	struct varlena *x, *unit_num;
+
+	x = (void*)OidFunctionCall2(
+		numeric_add,
+		PointerGetDatum( neutral ),
+		OidFunctionCall1( int4_numeric, Int32GetDatum( slack ) )
+		);
+	x = (void*)OidFunctionCall2(
+		numeric_round_scale, PointerGetDatum( x ), Int32GetDatum( 20 )
+		);
+	x = (void*)OidFunctionCall2(
+		numeric_div,
+		PointerGetDatum( x ),
+		PointerGetDatum( ent->currency_rate )
+		);
+	x = (void*)OidFunctionCall2(
+		numeric_round_scale,
+		PointerGetDatum( x ),
+		Int32GetDatum( ent->currency_minor )
+		);
+
+	snprintf(unit, sizeof(unit), "1e-%d", ent->currency_minor);
+	unit_num = (void*)OidFunctionCall3(
+		numeric_in,
+		CStringGetDatum( unit ),
+		ObjectIdGetDatum( numeric_oid ),
+		Int32GetDatum( -1 )
+		);
+	return (void*)OidFunctionCall2(
+		slack < 0 ? numeric_sub : numeric_add,
+		PointerGetDatum( x ),
+		PointerGetDatum( unit_num )
+		);
+}
+
+PG_FUNCTION_INFO_V1(currency_cmp_support);
+Datum
+currency_cmp_support(PG_FUNCTION_ARGS)
+{
+	Node* rawreq = (Node*)PG_GETARG_POINTER(0);
+	SupportRequestSimplify* req;
+	FuncExpr* fcall;
+	Node *left, *right;
+	Var* var;
+	Const* cnst;
+	RangeTblEntry* rte;
+	char *fname, *nspname;
+	int kind, i, ncodes = 0;
+	int16* codes;
+	Oid nsp, currency_type, tla_type, code_fn, value_fn, rates_rel;
+	Oid tla_eq, tla_lt, tla_gt, num_ge, num_le, num_op, cur_op;
+	currency* amount;
+	ccc_ent* const_info;
+	struct varlena *amount_num, *neutral;
+	Expr *code_expr, *value_expr;
+	List* branches = NIL;
+
+	if (!IsA(rawreq, SupportRequestSimplify))
+		PG_RETURN_POINTER(NULL);
+	req = (void*)rawreq;
+	fcall = req->fcall;
+	if (!req->root || list_length(fcall->args) != 2)
+		PG_RETURN_POINTER(NULL);
+
+	fname = get_func_name(fcall->funcid);
+	for (kind = 0; kind < lengthof(cmp_funcname); kind++)
+		if (strcmp(fname, cmp_funcname[kind]) == 0)
+			break;
+	if (kind == lengthof(cmp_funcname))
+		PG_RETURN_POINTER(NULL);
+
+	/* column op constant, or constant op column */
+	left = linitial(fcall->args);
+	right = lsecond(fcall->args);
+	if (IsA(left, Var) && IsA(right, Const)) {
+		var = (Var*)left;
+		cnst = (Const*)right;
+	}
+	else if (IsA(left, Const) && IsA(right, Var)) {
+		var = (Var*)right;
+		cnst = (Const*)left;
+		kind = cmp_commute[kind];
+	}
+	else
+		PG_RETURN_POINTER(NULL);
+	if (cnst->constisnull || var->varlevelsup != 0 ||
+	    var->varno < 1 || var->varno > list_length(req->root->parse->rtable))
+		PG_RETURN_POINTER(NULL);
+	rte = planner_rt_fetch(var->varno, req->root);
+	if (rte->rtekind != RTE_RELATION)
+		PG_RETURN_POINTER(NULL);
+
+	/* our own objects live alongside the comparison function */
+	nsp = get_func_namespace(fcall->funcid);
+	nspname = get_namespace_name(nsp);
+	currency_type = var->vartype;
+	code_fn = LookupFuncName(qualified_name(nspname, "code"), 1,
+				 &currency_type, true);
+	value_fn = LookupFuncName(qualified_name(nspname, "value"), 1,
+				  &currency_type, true);
+	rates_rel = get_relname_relid("currency_rate", nsp);
+	if (!OidIsValid(code_fn) || !OidIsValid(value_fn) ||
+	    !OidIsValid(rates_rel) ||
+	    !has_code_index(rte->relid, var->varattno, code_fn))
+		PG_RETURN_POINTER(NULL);
+
+	tla_type = get_func_rettype(code_fn);
+	tla_eq = OpernameGetOprid(qualified_name(nspname, "="), tla_type, tla_type);
+	tla_lt = OpernameGetOprid(qualified_name(nspname, "#<#"), tla_type, tla_type);
+	tla_gt = OpernameGetOprid(qualified_name(nspname, "#>#"), tla_type, tla_type);
+	cur_op = OpernameGetOprid(qualified_name(nspname, cmp_opname[kind]),
+				  currency_type, currency_type);
+	num_op = OpernameGetOprid(qualified_name("pg_catalog", cmp_opname[kind]),
+				  numeric_oid, numeric_oid);
+	num_ge = OpernameGetOprid(qualified_name("pg_catalog", ">="),
+				  numeric_oid, numeric_oid);
+	num_le = OpernameGetOprid(qualified_name("pg_catalog", "<="),
+				  numeric_oid, numeric_oid);
+	if (!OidIsValid(tla_eq) || !OidIsValid(tla_lt) || !OidIsValid(tla_gt) ||
+	    !OidIsValid(cur_op))
+		PG_RETURN_POINTER(NULL);
+
 	update_currency_code_cache();
-	int diff = currency_cmp(a, b);
+	amount = DatumGetCurrency(cnst->constvalue);
+	const_info = lookup_currency_code(amount->currency_code);
+	if (!const_info)
+		PG_RETURN_POINTER(NULL);
+
+	/* the constant's neutral value, before any working scale rounding */
+	amount_num = _currency_numeric(amount);
+	neutral = (void*)OidFunctionCall2(
+		numeric_mul,
+		PointerGetDatum( amount_num ),
+		PointerGetDatum( const_info->currency_rate )
+		);
+
+	code_expr = (Expr*)makeFuncExpr(code_fn, tla_type,
+					list_make1(copyObject(var)),
+					InvalidOid, InvalidOid,
+					COERCE_EXPLICIT_CALL);
+	value_expr = (Expr*)makeFuncExpr(value_fn, numeric_oid,
+					 list_make1(copyObject(var)),
+					 InvalidOid, InvalidOid,
+					 COERCE_EXPLICIT_CALL);
+	codes = palloc(sizeof(int16) * (ccc_size + 1));
+
+	for (i = 0; i < ccc_size; i++) {
+		ccc_ent* ent = &currency_code_cache[i];
+		List* conds = NIL;
+
+		if (ent == const_info) {
+			/* same code: compared directly, without the rates */
+			conds = list_make1(make_opclause(
+				num_op, BOOLOID, false, copyObject(value_expr),
+				(Expr*)make_numeric_const(amount_num),
+				InvalidOid, InvalidOid));
+		}
+		else {
+			if (DatumGetInt32(OidFunctionCall2(
+				    numeric_cmp,
+				    PointerGetDatum( ent->currency_rate ),
+				    OidFunctionCall1( int4_numeric, Int32GetDatum( 0 ) )
+				    )) <= 0)
+				continue;
+			if (kind != CMP_LT && kind != CMP_LE)
+				conds = lappend(conds, make_opclause(
+					num_ge, BOOLOID, false, copyObject(value_expr),
+					(Expr*)make_numeric_const(
+						neutral_bound(neutral, -1, ent)),
+					InvalidOid, InvalidOid));
+			if (kind != CMP_GT && kind != CMP_GE)
+				conds = lappend(conds, make_opclause(
+					num_le, BOOLOID, false, copyObject(value_expr),
+					(Expr*)make_numeric_const(
+						neutral_bound(neutral, 1, ent)),
+					InvalidOid, InvalidOid));
+		}
+		conds = lcons(make_opclause(
+				      tla_eq, BOOLOID, false, copyObject(code_expr),
+				      (Expr*)makeConst(tla_type, -1, InvalidOid, 2,
+						       Int16GetDatum(ent->currency_code),
+						       false, true),
+				      InvalidOid, InvalidOid),
+			      conds);
+		branches = lappend(branches, make_andclause(conds));
+		codes[ncodes++] = ent->currency_code;
+	}
+
+	/*
+	 * codes not covered above (unknown, or with no usable rate) still
+	 * go to the original comparison, through ranges of code() so the
+	 * index can be used for them too
+	 */
+	qsort(codes, ncodes, sizeof(int16), cmp_int16);
+	codes[ncodes] = PG_INT16_MAX;
+	for (i = 0; i <= ncodes; i++) {
+		int16 lo = i > 0 ? codes[i - 1] : -1;
+		int16 hi = codes[i];
+		List* conds = NIL;
+
+		if (hi - lo <= 1)
+			continue;
+		if (lo >= 0)
+			conds = lappend(conds, make_opclause(
+				tla_gt, BOOLOID, false, copyObject(code_expr),
+				(Expr*)makeConst(tla_type, -1, InvalidOid, 2,
+						 Int16GetDatum(lo), false, true),
+				InvalidOid, InvalidOid));
+		if (i < ncodes)
+			conds = lappend(conds, make_opclause(
+				tla_lt, BOOLOID, false, copyObject(code_expr),
+				(Expr*)makeConst(tla_type, -1, InvalidOid, 2,
+						 Int16GetDatum(hi), false, true),
+				InvalidOid, InvalidOid));
+		branches = lappend(branches,
+				   conds ? (Expr*)make_andclause(conds)
+					 : (Expr*)makeBoolConst(true, false));
+	}
+
+	req->root->glob->relationOids =
+		lappend_oid(req->root->glob->relationOids, rates_rel);
+
+	PG_RETURN_POINTER(make_andclause(list_make2(
+		make_orclause(branches),
+		make_opclause(cur_op, BOOLOID, false,
+			      (Expr*)copyObject(var), (Expr*)copyObject(cnst),
+			      InvalidOid, InvalidOid)
+		)));
+}
+
+/*
+ * trigger on currency_rate and currency_pair_rate: plans that folded
+ * in the rates (see currency_cmp_support), and the pair matrix,
+ * depend on the table, so invalidate them
+ */
+PG_FUNCTION_INFO_V1(currency_rate_changed);
+Datum
+currency_rate_changed(PG_FUNCTION_ARGS)
+{
+	TriggerData* trigdata = (TriggerData*)fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "currency_rate_changed: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * "native" ordering: by currency code, then by amount within a code.
+ * Unlike the neutral comparisons above this does not depend on the
+ * exchange rates, so it is IMMUTABLE and safe to index; it is the
+ * ordering used by the currencyrange type.
+ */
+int currency_native_cmp(currency* a, currency* b)
+{
+	int rv;
+	struct varlena *a_n, *b_n;
+
+	if (a->currency_code != b->currency_code)
+		return (a->currency_code < b->currency_code) ? -1 : 1;
+
+	a_n = _currency_numeric(a);
+	b_n = _currency_numeric(b);
+	rv = OidFunctionCall2(
+		numeric_cmp,
+		PointerGetDatum( a_n ),
+		PointerGetDatum( b_n )
+		);
+	pfree(a_n);
+	pfree(b_n);
+	return rv;
+}
+
+PG_FUNCTION_INFO_V1(currency_native_eq);
+Datum
+currency_native_eq(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff == 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_native_ne);
+Datum
+currency_native_ne(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff != 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_native_lt);
+Datum
+currency_native_lt(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff < 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_native_le);
+Datum
+currency_native_le(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff <= 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_native_gt);
+Datum
+currency_native_gt(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff > 0);
+}
 
-	PG_FREE_IF_COPY(a, 0);
-	PG_FREE_IF_COPY(b, 1);
+PG_FUNCTION_INFO_V1(currency_native_ge);
+Datum
+currency_native_ge(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
+	PG_RETURN_BOOL(diff >= 0);
+}
+
+PG_FUNCTION_INFO_V1(currency_native_btcmp);
+Datum
+currency_native_btcmp(PG_FUNCTION_ARGS)
+{
+	currency* a = PG_GETARG_CURRENCY(0);
+	currency* b = PG_GETARG_CURRENCY(1);
+	int diff = currency_native_cmp(a, b);
+
+	PG_FREE_CURRENCY_IF_COPY(a, 0);
+	PG_FREE_CURRENCY_IF_COPY(b, 1);
 	PG_RETURN_INT32(diff);
 }
 
+/*
+ * hashing consistent with native equality, so also IMMUTABLE: the
+ * code's hash is mixed with the amount's.  The mixing only carries
+ * bits upwards, so that the low 32 bits of the extended hash with
+ * seed 0 match the plain hash, as hash opclasses require.
+ */
+PG_FUNCTION_INFO_V1(currency_native_hash);
+Datum
+currency_native_hash(PG_FUNCTION_ARGS)
+{
+	currency* amount = PG_GETARG_CURRENCY(0);
+	struct varlena* numeric = _currency_numeric(amount);
+	uint32 code_hash, numeric_hash;
+
+	code_hash = DatumGetUInt32(OidFunctionCall1(
+		hashint2, Int16GetDatum(amount->currency_code)
+		));
+	numeric_hash = DatumGetUInt32(OidFunctionCall1(
+		hash_numeric, PointerGetDatum(numeric)
+		));
+	pfree(numeric);
+	PG_FREE_CURRENCY_IF_COPY(amount, 0);
+
+	PG_RETURN_UINT32(code_hash * 0x7f4a7c15U + numeric_hash);
+}
+
+PG_FUNCTION_INFO_V1(currency_native_hash_extended);
+Datum
+currency_native_hash_extended(PG_FUNCTION_ARGS)
+{
+	currency* amount = PG_GETARG_CURRENCY(0);
+	Datum seed = PG_GETARG_DATUM(1);
+	struct varlena* numeric = _currency_numeric(amount);
+	uint64 code_hash, numeric_hash;
+
+	code_hash = DatumGetUInt64(DirectFunctionCall2(
+		hashint2extended, Int16GetDatum(amount->currency_code), seed
+		));
+	numeric_hash = DatumGetUInt64(DirectFunctionCall2(
+		hash_numeric_extended, PointerGetDatum(numeric), seed
+		));
+	pfree(numeric);
+	PG_FREE_CURRENCY_IF_COPY(amount, 0);
+
+	PG_RETURN_UINT64(code_hash * UINT64CONST(0x9e3779b97f4a7c15) + numeric_hash);
+}
+
 PG_FUNCTION_INFO_V1(currency_hash);
 Datum
 currency_hash(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
-	struct tv* numeric;
+	currency* amount = PG_GETARG_CURRENCY(0);
+	struct varlena* numeric;
+	neutral_memo_ent* ent;
 	int32 numeric_hash;
 	update_currency_code_cache();
-	numeric = currency_neutral(amount);
-	numeric_hash = OidFunctionCall1(hash_numeric, numeric);
-	pfree(numeric);
-	PG_FREE_IF_COPY(amount, 0);
+	if (fcinfo->flinfo) {
+		ent = neutral_memo_lookup(fcinfo->flinfo, amount);
+		if (!ent->has_hash) {
+			ent->hash = OidFunctionCall1(hash_numeric,
+						     PointerGetDatum(ent->neutral));
+			ent->has_hash = true;
+		}
+		numeric_hash = ent->hash;
+	}
+	else {
+		numeric = currency_neutral(amount);
+		numeric_hash = OidFunctionCall1(hash_numeric, PointerGetDatum(numeric));
+		pfree(numeric);
+	}
+	PG_FREE_CURRENCY_IF_COPY(amount, 0);
 
 	PG_RETURN_INT32(numeric_hash);
 }
 
-currency* currency_math2(int operator, currency *arg1, currency* arg2)
+/* the NUMERIC result of "+" or "-", and the code it is in */
+static struct varlena*
+currency_math2_numeric(int operator, currency *arg1, currency* arg2,
+		       int16* currency_code)
 {
-	int16 currency_code;
-	struct tv *arg1_num, *arg2_num;
-	struct tv *result_num;
-	currency *result;
+	struct varlena *arg1_num, *arg2_num;
+	struct varlena *result_num;
 
 	if (arg1->currency_code != arg2->currency_code) {
-		currency_code = currency_code_cache[0].currency_code;
+		*currency_code = currency_code_cache[0].currency_code;
 		arg1_num = currency_neutral(arg1);
 		arg2_num = currency_neutral(arg2);
 	}
 	else {
-		currency_code = arg1->currency_code;
+		*currency_code = arg1->currency_code;
 		arg1_num = _currency_numeric(arg1);
 		arg2_num = _currency_numeric(arg2);
 	}
 
-	result_num = OidFunctionCall2(
+	result_num = (void*)OidFunctionCall2(
 		operator,
 		PointerGetDatum(arg1_num), PointerGetDatum(arg2_num)
 		);
@@ -742,47 +2184,139 @@ currency* currency_math2(int operator, currency *arg1, currency* arg2)
 	pfree(arg1_num);
 	pfree(arg2_num);
 
+	if (arg1->currency_code != arg2->currency_code)
+		result_num = (void*)round_working_scale(
+			(void*)result_num, currency_code_cache
+			);
+
+	return result_num;
+}
+
+currency* currency_math2(int operator, currency *arg1, currency* arg2)
+{
+	int16 currency_code;
+	struct varlena *result_num;
+	currency *result;
+
+	result_num = currency_math2_numeric(operator, arg1, arg2, &currency_code);
 	result = make_currency(result_num, currency_code);
 	pfree(result_num);
 	return result;
 }
 
+/*
+ * "+" or "-" for the function's arguments: when the first argument
+ * is a read-write expanded object the result is written into it,
+ * otherwise a new flat value is returned.
+ */
+static Datum
+currency_math2_datum(FunctionCallInfo fcinfo, int operator,
+		     currency* arg1, currency* arg2)
+{
+	Datum target = PG_GETARG_DATUM(0);
+	int16 currency_code;
+	struct varlena* result_num;
+
+	if (!VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(target)))
+		return PointerGetDatum(currency_math2(operator, arg1, arg2));
+
+	result_num = currency_math2_numeric(operator, arg1, arg2, &currency_code);
+	store_expanded_currency(target, result_num, currency_code);
+	pfree(result_num);
+	return target;
+}
+
 PG_FUNCTION_INFO_V1(currency_add);
 Datum
 currency_add(PG_FUNCTION_ARGS)
 {
-	currency* augend = (void*)PG_GETARG_POINTER(0);
-	currency* addend = (void*)PG_GETARG_POINTER(1);
+	currency* augend = PG_GETARG_CURRENCY(0);
+	currency* addend = PG_GETARG_CURRENCY(1);
 
-	currency* sum;
+	Datum sum;
 
 	update_currency_code_cache();
 
-	sum = currency_math2(numeric_add, augend, addend);
+	sum = currency_math2_datum(fcinfo, numeric_add, augend, addend);
 
-	PG_FREE_IF_COPY(augend, 0);
-	PG_FREE_IF_COPY(addend, 1);
+	PG_FREE_CURRENCY_IF_COPY(augend, 0);
+	PG_FREE_CURRENCY_IF_COPY(addend, 1);
 
-	PG_RETURN_POINTER(sum);
+	PG_RETURN_DATUM(sum);
 }
 
 PG_FUNCTION_INFO_V1(currency_sub);
 Datum
 currency_sub(PG_FUNCTION_ARGS)
 {
-	currency* minuend = (void*)PG_GETARG_POINTER(0);
-	currency* subtrahend = (void*)PG_GETARG_POINTER(1);
+	currency* minuend = PG_GETARG_CURRENCY(0);
+	currency* subtrahend = PG_GETARG_CURRENCY(1);
 
-	currency* difference;
+	Datum difference;
 
 	update_currency_code_cache();
 
-	difference = currency_math2(numeric_sub, minuend, subtrahend);
+	difference = currency_math2_datum(fcinfo, numeric_sub, minuend, subtrahend);
+
+	PG_FREE_CURRENCY_IF_COPY(minuend, 0);
+	PG_FREE_CURRENCY_IF_COPY(subtrahend, 1);
+
+	PG_RETURN_DATUM(difference);
+}
+
+/*
+ * make an accumulator: an expanded copy of the value, which "+" and
+ * "-" will update in place when PL/pgSQL hands them the variable as
+ * a read-write argument (PostgreSQL 18 and later, see
+ * currency_support), eg
+ *
+ *    total := currency_accumulator('0 USD');
+ *    FOR line IN ... LOOP
+ *        total := total + line.amount;
+ *    END LOOP;
+ */
+PG_FUNCTION_INFO_V1(currency_accumulator);
+Datum
+currency_accumulator(PG_FUNCTION_ARGS)
+{
+	currency* amount = PG_GETARG_CURRENCY(0);
+
+	PG_RETURN_DATUM(expand_currency(amount, CurrentMemoryContext));
+}
+
+/* whether the argument arrived as an expanded object, for testing */
+PG_FUNCTION_INFO_V1(currency_is_expanded);
+Datum
+currency_is_expanded(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(VARATT_IS_EXTERNAL_EXPANDED(PG_GETARG_POINTER(0)));
+}
 
-	PG_FREE_IF_COPY(minuend, 0);
-	PG_FREE_IF_COPY(subtrahend, 1);
+/*
+ * planner support for "+" and "-": tell PL/pgSQL that the first
+ * argument may be passed read-write, so that "x := x + y" updates an
+ * expanded x in place.
+ */
+PG_FUNCTION_INFO_V1(currency_support);
+Datum
+currency_support(PG_FUNCTION_ARGS)
+{
+	Node* rawreq = (Node*)PG_GETARG_POINTER(0);
+	Node* ret = NULL;
+
+#if PG_VERSION_NUM >= 180000
+	if (IsA(rawreq, SupportRequestModifyInPlace)) {
+		SupportRequestModifyInPlace* req = (void*)rawreq;
+		Param* arg = linitial(req->args);
+
+		if (arg && IsA(arg, Param) &&
+		    arg->paramkind == PARAM_EXTERN &&
+		    arg->paramid == req->paramid)
+			ret = (Node*)arg;
+	}
+#endif
 
-	PG_RETURN_POINTER(difference);
+	PG_RETURN_POINTER(ret);
 }
 
 PG_FUNCTION_INFO_V1(currency_mul);
@@ -791,13 +2325,13 @@ currency_mul(PG_FUNCTION_ARGS)
 {
 	bool num_first = get_fn_expr_argtype(fcinfo->flinfo, 0) == numeric_oid;
 
-	currency* amount = (void*)PG_GETARG_POINTER( num_first ? 1 : 0 );
-	struct tv* factor = (void*)PG_GETARG_POINTER( num_first ? 0 : 1 );
-	struct tv *amount_num, *product_num;
+	currency* amount = PG_GETARG_CURRENCY(num_first ? 1 : 0);
+	struct varlena* factor = (void*)PG_GETARG_POINTER( num_first ? 0 : 1 );
+	struct varlena *amount_num, *product_num;
 	currency* product;
 
 	amount_num = _currency_numeric(amount);
-	product_num = OidFunctionCall2(
+	product_num = (void*)OidFunctionCall2(
 		numeric_mul,
 		PointerGetDatum(amount_num),
 		PointerGetDatum(factor)
@@ -808,7 +2342,7 @@ currency_mul(PG_FUNCTION_ARGS)
 	pfree(amount_num);
 	pfree(product_num);
 
-	PG_FREE_IF_COPY(amount, num_first ? 1 : 0);
+	PG_FREE_CURRENCY_IF_COPY(amount, num_first ? 1 : 0);
 	PG_FREE_IF_COPY(factor, num_first ? 0 : 1);
 
 	PG_RETURN_POINTER(product);
@@ -821,9 +2355,10 @@ currency_div(PG_FUNCTION_ARGS)
 	bool return_currency =
 		get_fn_expr_argtype(fcinfo->flinfo, 1) == numeric_oid;
 
-	currency* dividend = (void*)PG_GETARG_POINTER( 0 );
+	currency* dividend = PG_GETARG_CURRENCY(0);
+	int16 dividend_code = dividend->currency_code;
 	currency *divisor, *quotient;
-	struct tv *dividend_num, *divisor_num, *quotient_num;
+	struct varlena *dividend_num, *divisor_num, *quotient_num;
 
 	if (return_currency) {
 		// dividing a currency by a numeric
@@ -832,7 +2367,7 @@ currency_div(PG_FUNCTION_ARGS)
 	}
 	else {
 		// dividing two currencies
-		divisor = (void*)PG_GETARG_POINTER(1);
+		divisor = PG_GETARG_CURRENCY(1);
 		if (dividend->currency_code != divisor->currency_code) {
 			update_currency_code_cache();
 			dividend_num = currency_neutral(dividend);
@@ -844,19 +2379,24 @@ currency_div(PG_FUNCTION_ARGS)
 		}
 	}
 
-	quotient_num = OidFunctionCall2(
+	quotient_num = (void*)OidFunctionCall2(
 		numeric_div,
 		PointerGetDatum(dividend_num),
 		PointerGetDatum(divisor_num)
 		);
 
-	PG_FREE_IF_COPY(dividend, 0);
+	PG_FREE_CURRENCY_IF_COPY(dividend, 0);
 	pfree(dividend_num);
 
 	if (return_currency) {
+		update_currency_code_cache();
+		quotient_num = (void*)round_working_scale(
+			(void*)quotient_num,
+			lookup_currency_code(dividend_code)
+			);
 		quotient = make_currency(
 			quotient_num,
-			dividend->currency_code
+			dividend_code
 			);
 		PG_FREE_IF_COPY(divisor_num, 1);
 		pfree(quotient_num);
@@ -864,7 +2404,7 @@ currency_div(PG_FUNCTION_ARGS)
 	}
 	else {
 		pfree(divisor_num);
-		PG_FREE_IF_COPY(divisor, 1);
+		PG_FREE_CURRENCY_IF_COPY(divisor, 1);
 		PG_RETURN_POINTER(quotient_num);
 	}
 }
@@ -873,11 +2413,11 @@ PG_FUNCTION_INFO_V1(currency_uplus);
 Datum
 currency_uplus(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
-	struct tv* num = _currency_numeric(amount);
+	currency* amount = PG_GETARG_CURRENCY(0);
+	struct varlena* num = _currency_numeric(amount);
 	currency* copy = make_currency(num, amount->currency_code);
 
-	PG_FREE_IF_COPY(amount, 0);
+	PG_FREE_CURRENCY_IF_COPY(amount, 0);
 	pfree(num);
 
 	PG_RETURN_POINTER(copy);
@@ -887,14 +2427,2050 @@ PG_FUNCTION_INFO_V1(currency_uminus);
 Datum
 currency_uminus(PG_FUNCTION_ARGS)
 {
-	currency* amount = (void*)PG_GETARG_POINTER(0);
-	struct tv* num = _currency_numeric(amount);
-	struct tv* negnum = OidFunctionCall1( numeric_uminus, num );
+	currency* amount = PG_GETARG_CURRENCY(0);
+	struct varlena* num = _currency_numeric(amount);
+	struct varlena* negnum = (void*)OidFunctionCall1( numeric_uminus, PointerGetDatum( num ) );
 	currency* neg = make_currency(negnum, amount->currency_code);
 
-	PG_FREE_IF_COPY(amount, 0);
+	PG_FREE_CURRENCY_IF_COPY(amount, 0);
 	pfree(num);
 	pfree(negnum);
 
 	PG_RETURN_POINTER(neg);
 }
+
+/*
+ * sum(currency) aggregate.
+ *
+ * The transition state keeps one running total per currency code
+ * seen, so that adding or (for moving-window frames) removing a row
+ * only touches the total for that row's code.  Conversion to the
+ * exchange currency is left until the final function, and only
+ * happens if more than one code is still live in the frame.
+ */
+typedef struct currency_sum_ent
+{
+	int16 currency_code;
+	int64 count;
+	struct varlena* total;
+} currency_sum_ent;
+
+typedef struct currency_sum_state
+{
+	MemoryContext aggcontext;
+	int nentries;
+	int allocated;
+	currency_sum_ent* entries;
+} currency_sum_state;
+
+static currency_sum_ent*
+currency_sum_lookup(currency_sum_state* state, int16 currency_code, bool create)
+{
+	int i;
+
+	for (i = 0; i < state->nentries; i++) {
+		if (state->entries[i].currency_code == currency_code)
+			return &state->entries[i];
+	}
+	if (!create)
+		return 0;
+
+	if (state->nentries == state->allocated) {
+		state->allocated *= 2;
+		state->entries = repalloc(
+			state->entries,
+			sizeof(currency_sum_ent) * state->allocated
+			);
+	}
+	i = state->nentries++;
+	state->entries[i].currency_code = currency_code;
+	state->entries[i].count = 0;
+	state->entries[i].total = 0;
+	return &state->entries[i];
+}
+
+/* add (or subtract) amount into the running total for its code */
+static void
+currency_sum_apply(currency_sum_state* state, currency* amount, int operator)
+{
+	currency_sum_ent* ent;
+	struct varlena* amount_num;
+	struct varlena* total;
+	MemoryContext oldcontext;
+
+	ent = currency_sum_lookup(
+		state, amount->currency_code, operator == numeric_add
+		);
+	if (!ent)
+		elog(ERROR, "currency code '%s' not in aggregate state",
+		     emit_tla( amount->currency_code ));
+
+	amount_num = _currency_numeric(amount);
+	if (ent->total) {
+		total = (void*)OidFunctionCall2(
+			operator,
+			PointerGetDatum(ent->total),
+			PointerGetDatum(amount_num)
+			);
+		pfree(amount_num);
+	}
+	else {
+		total = amount_num;
+	}
+
+	oldcontext = MemoryContextSwitchTo(state->aggcontext);
+	if (ent->total)
+		pfree(ent->total);
+	ent->total = palloc( VARSIZE(total) );
+	memcpy( ent->total, total, VARSIZE(total) );
+	MemoryContextSwitchTo(oldcontext);
+	pfree(total);
+
+	ent->count += (operator == numeric_add ? 1 : -1);
+}
+
+PG_FUNCTION_INFO_V1(currency_sum_accum);
+Datum
+currency_sum_accum(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext, oldcontext;
+	currency_sum_state* state;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "currency_sum_accum called in non-aggregate context");
+
+	if (PG_ARGISNULL(0)) {
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+		state = palloc(sizeof(currency_sum_state));
+		state->aggcontext = aggcontext;
+		state->nentries = 0;
+		state->allocated = 4;
+		state->entries = palloc(sizeof(currency_sum_ent) * state->allocated);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else {
+		state = (void*)PG_GETARG_POINTER(0);
+	}
+
+	if (!PG_ARGISNULL(1))
+		currency_sum_apply(
+			state, PG_GETARG_CURRENCY(1), numeric_add
+			);
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(currency_sum_inverse);
+Datum
+currency_sum_inverse(PG_FUNCTION_ARGS)
+{
+	currency_sum_state* state;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "currency_sum_inverse called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "currency_sum_inverse called with NULL state");
+	state = (void*)PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+		currency_sum_apply(
+			state, PG_GETARG_CURRENCY(1), numeric_sub
+			);
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(currency_sum_final);
+Datum
+currency_sum_final(PG_FUNCTION_ARGS)
+{
+	currency_sum_state* state;
+	currency_sum_ent* ent;
+	currency_sum_ent* only = 0;
+	struct varlena *total = 0, *neutral, *sum;
+	ccc_ent* cc_info;
+	int i, live = 0;
+	currency* result;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+	state = (void*)PG_GETARG_POINTER(0);
+
+	for (i = 0; i < state->nentries; i++) {
+		if (state->entries[i].count > 0) {
+			only = &state->entries[i];
+			live++;
+		}
+	}
+	if (!live)
+		PG_RETURN_NULL();
+
+	if (live == 1)
+		PG_RETURN_POINTER(make_currency(only->total, only->currency_code));
+
+	/* several codes in the frame: sum in the exchange currency */
+	update_currency_code_cache();
+	for (i = 0; i < state->nentries; i++) {
+		ent = &state->entries[i];
+		if (ent->count <= 0)
+			continue;
+
+		cc_info = lookup_currency_code(ent->currency_code);
+		if (!cc_info)
+			elog(ERROR, "currency code '%s' not in currency_rate table",
+			     emit_tla( ent->currency_code ));
+		if (cc_info == currency_code_cache) {
+			neutral = ent->total;
+		}
+		else {
+			neutral = (void*)OidFunctionCall2(
+				numeric_mul,
+				PointerGetDatum(ent->total),
+				PointerGetDatum(cc_info->currency_rate)
+				);
+			neutral = round_working_scale(neutral, cc_info);
+		}
+
+		if (total) {
+			sum = (void*)OidFunctionCall2(
+				numeric_add,
+				PointerGetDatum(total),
+				PointerGetDatum(neutral)
+				);
+			pfree(total);
+			total = sum;
+		}
+		else {
+			total = (void*)OidFunctionCall1(
+				numeric_uplus, PointerGetDatum(neutral)
+				);
+		}
+		if (neutral != ent->total)
+			pfree(neutral);
+	}
+
+	/* as for mixed code "+" */
+	total = round_working_scale(total, currency_code_cache);
+	result = make_currency(total, currency_code_cache[0].currency_code);
+	pfree(total);
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * currency_bench(operation, iterations, sample) - run one of the
+ * internal routines in a tight loop over the sample values, so that
+ * changes to the C paths can be measured without executor overhead.
+ *
+ * Returns the time per operation, the bytes of memory chunks
+ * allocated per operation, and how many times the rates cache was
+ * reloaded during the run.  The timed loop only resets its memory
+ * context every BENCH_RESET_EVERY operations; allocation is measured
+ * afterwards, in a separate pass of at most BENCH_ALLOC_PASS
+ * operations that is not timed.
+ */
+#define BENCH_RESET_EVERY 1024
+#define BENCH_ALLOC_PASS 1000
+
+typedef enum
+{
+	BENCH_PARSE_TLA,
+	BENCH_EMIT_TLA_BUF,
+	BENCH_PARSE_CURRENCY,
+	BENCH_CURRENCY_CMP,
+	BENCH_CURRENCY_NEUTRAL,
+	BENCH_CURRENCY_FORMAT
+} bench_op;
+
+static const char* bench_op_names[] = {
+	"parse_tla",
+	"emit_tla_buf",
+	"parse_currency",
+	"currency_cmp",
+	"currency_neutral",
+	"currency_format",
+	NULL
+};
+
+static Datum
+bench_op_run(int op, currency* a, currency* b, char* string, char* tla_buf)
+{
+	switch (op) {
+	case BENCH_PARSE_TLA:
+		return parse_tla(string);
+	case BENCH_EMIT_TLA_BUF:
+		emit_tla_buf(a->currency_code, tla_buf);
+		return tla_buf[0];
+	case BENCH_PARSE_CURRENCY:
+		return PointerGetDatum(parse_currency(string));
+	case BENCH_CURRENCY_CMP:
+		update_currency_code_cache();
+		return currency_cmp(a, b);
+	case BENCH_CURRENCY_NEUTRAL:
+		update_currency_code_cache();
+		return PointerGetDatum(currency_neutral(a));
+	case BENCH_CURRENCY_FORMAT:
+		return DirectFunctionCall1(currency_format, PointerGetDatum(a));
+	}
+	return 0;
+}
+
+/*
+ * the bytes of a context's blocks that are handed out in chunks, so
+ * that an operation allocating nothing adds nothing, however much of
+ * the keeper block is still free
+ */
+static Size
+bench_bytes_used(MemoryContext context)
+{
+	MemoryContextCounters counters;
+
+	memset(&counters, 0, sizeof(counters));
+#if PG_VERSION_NUM >= 170000
+	MemoryContextMemConsumed(context, &counters);
+#elif PG_VERSION_NUM >= 140000
+	context->methods->stats(context, NULL, NULL, &counters, false);
+#else
+	context->methods->stats(context, NULL, NULL, &counters);
+#endif
+	return counters.totalspace - counters.freespace;
+}
+
+PG_FUNCTION_INFO_V1(currency_bench);
+Datum
+currency_bench(PG_FUNCTION_ARGS)
+{
+	char* operation = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int32 iterations = PG_GETARG_INT32(1);
+	ArrayType* sample = PG_GETARG_ARRAYTYPE_P(2);
+	TupleDesc tupdesc;
+	Datum values[3];
+	bool nulls[3] = { false, false, false };
+	Datum* elems;
+	bool* elem_nulls;
+	int nelems, i, op;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	char** strings = 0;
+	char tla_buf[4];
+	volatile Datum sink = 0;
+	MemoryContext benchcontext, oldcontext;
+	instr_time start, duration;
+	int64 refreshes;
+	double alloc_bytes = 0;
+	currency *a, *b;
+
+	for (op = 0; bench_op_names[op]; op++)
+		if (strcmp(bench_op_names[op], operation) == 0)
+			break;
+	if (!bench_op_names[op])
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unknown operation \"%s\"", operation)
+				));
+	if (iterations <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("iterations must be positive")
+				));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(sample), &typlen, &typbyval, &typalign);
+	deconstruct_array(sample, ARR_ELEMTYPE(sample), typlen, typbyval,
+			  typalign, &elems, &elem_nulls, &nelems);
+	if (nelems == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("sample must not be empty")
+				));
+	for (i = 0; i < nelems; i++) {
+		if (elem_nulls[i])
+			ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("sample must not contain nulls")
+					));
+		elems[i] = PointerGetDatum(DatumGetCurrency(elems[i]));
+	}
+
+	/* inputs for the parsing benchmarks */
+	if (op == BENCH_PARSE_TLA || op == BENCH_PARSE_CURRENCY) {
+		strings = palloc(sizeof(char*) * nelems);
+		for (i = 0; i < nelems; i++) {
+			a = (currency*)DatumGetPointer(elems[i]);
+			strings[i] = (op == BENCH_PARSE_TLA)
+				? emit_tla(a->currency_code)
+				: emit_currency(a);
+		}
+	}
+
+	update_currency_code_cache();
+	refreshes = ccc_refreshes;
+
+	benchcontext = AllocSetContextCreate(
+		CurrentMemoryContext,
+		"currency_bench",
+		ALLOCSET_SMALL_MINSIZE,
+		ALLOCSET_SMALL_INITSIZE,
+		ALLOCSET_SMALL_MAXSIZE
+		);
+	oldcontext = MemoryContextSwitchTo(benchcontext);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (i = 0; i < iterations; i++) {
+		a = (currency*)DatumGetPointer(elems[i % nelems]);
+		b = (currency*)DatumGetPointer(elems[(i + 1) % nelems]);
+		sink = bench_op_run(op, a, b,
+				    strings ? strings[i % nelems] : NULL, tla_buf);
+		if (i % BENCH_RESET_EVERY == BENCH_RESET_EVERY - 1)
+			MemoryContextReset(benchcontext);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	MemoryContextReset(benchcontext);
+
+	{
+		int n = Min(iterations, BENCH_ALLOC_PASS);
+		Size baseline = bench_bytes_used(benchcontext);
+
+		for (i = 0; i < n; i++) {
+			a = (currency*)DatumGetPointer(elems[i % nelems]);
+			b = (currency*)DatumGetPointer(elems[(i + 1) % nelems]);
+			sink = bench_op_run(op, a, b,
+					    strings ? strings[i % nelems] : NULL,
+					    tla_buf);
+			alloc_bytes += bench_bytes_used(benchcontext) - baseline;
+			MemoryContextReset(benchcontext);
+		}
+		alloc_bytes /= n;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(benchcontext);
+	(void) sink;
+
+	values[0] = Float8GetDatum(
+		INSTR_TIME_GET_DOUBLE(duration) * 1e9 / iterations
+		);
+	values[1] = Float8GetDatum(alloc_bytes);
+	values[2] = Int64GetDatum(ccc_refreshes - refreshes);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * currency_vector: a series of amounts in one currency, stored as
+ * int64 multiples of 10^-scale after a single code and scale, rather
+ * than as an array of separate currency values.  The kernels below
+ * are loops over the int64 array with no function calls or error
+ * checks inside.  Sum, min, max and the counts are plain int64
+ * arithmetic which the compiler can vectorise; multiplying and
+ * converting need a 128-bit division for each amount, so they are not
+ * vectorised.
+ */
+typedef struct currency_vector
+{
+	int32 vl_len_;	/* varlena header */
+	int16 currency_code;
+	int16 scale;	/* digits after the decimal point */
+	int64 amounts[1];	/* VARIABLE LENGTH ARRAY */
+} currency_vector;
+
+#define CV_MAX_SCALE 18
+#define CV_MAX_FACTOR_SCALE 36	/* 10^36 still fits in an int128 */
+#define CV_HDRSZ offsetof(currency_vector, amounts)
+#define CV_SIZE(n) (CV_HDRSZ + sizeof(int64) * (n))
+#define CV_COUNT(v) ((VARSIZE(v) - CV_HDRSZ) / sizeof(int64))
+#define PG_GETARG_CURRENCY_VECTOR(n) \
+	((currency_vector*)PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+static const int64 cv_pow10[CV_MAX_SCALE + 1] = {
+	INT64CONST(1), INT64CONST(10), INT64CONST(100), INT64CONST(1000),
+	INT64CONST(10000), INT64CONST(100000), INT64CONST(1000000),
+	INT64CONST(10000000), INT64CONST(100000000),
+	INT64CONST(1000000000), INT64CONST(10000000000),
+	INT64CONST(100000000000), INT64CONST(1000000000000),
+	INT64CONST(10000000000000), INT64CONST(100000000000000),
+	INT64CONST(1000000000000000), INT64CONST(10000000000000000),
+	INT64CONST(100000000000000000), INT64CONST(1000000000000000000)
+};
+
+typedef enum
+{
+	SCALE_EXACT,
+	SCALE_FLOOR,
+	SCALE_CEIL,
+	SCALE_ROUND	/* half away from zero */
+} scale_mode;
+
+static currency_vector*
+make_currency_vector(int16 currency_code, int scale, int count)
+{
+	currency_vector* v;
+
+	alloc_varlena(v, CV_SIZE(count));
+	v->currency_code = currency_code;
+	v->scale = scale;
+	return v;
+}
+
+/* number of digits after the decimal point in a number string */
+static int
+str_scale(const char* str)
+{
+	const char* point = strchr(str, '.');
+	int scale = 0;
+
+	if (point)
+		for (point++; *point >= '0' && *point <= '9'; point++)
+			scale++;
+	return scale;
+}
+
+/*
+ * parse a decimal number string into an integer number of units of
+ * 10^-scale; false if it is not a number or does not fit.
+ */
+static bool
+str_to_scaled(const char* str, int scale, scale_mode mode, int64* result)
+{
+	const char* p = str;
+	bool neg = false, in_frac = false, inexact = false, half = false;
+	int kept = 0, dropped = 0;
+	int64 v = 0;
+
+	while (*p == ' ')
+		p++;
+	if (*p == '-' || *p == '+')
+		neg = (*p++ == '-');
+	if (!((*p >= '0' && *p <= '9') || (*p == '.' && p[1] >= '0' && p[1] <= '9')))
+		return false;
+
+	for (; *p; p++) {
+		if (*p == '.' && !in_frac) {
+			in_frac = true;
+			continue;
+		}
+		if (*p < '0' || *p > '9')
+			break;
+		if (in_frac && kept == scale) {
+			if (dropped++ == 0 && *p >= '5')
+				half = true;
+			if (*p != '0')
+				inexact = true;
+			continue;
+		}
+		if (v > (PG_INT64_MAX - 9) / 10)
+			return false;
+		v = v * 10 + (*p - '0');
+		if (in_frac)
+			kept++;
+	}
+	while (*p == ' ')
+		p++;
+	if (*p)
+		return false;
+
+	for (; kept < scale; kept++) {
+		if (v > PG_INT64_MAX / 10)
+			return false;
+		v *= 10;
+	}
+
+	if (inexact) {
+		if (mode == SCALE_EXACT)
+			return false;
+		if ((mode == SCALE_FLOOR && neg) ||
+		    (mode == SCALE_CEIL && !neg) ||
+		    (mode == SCALE_ROUND && half)) {
+			if (v == PG_INT64_MAX)
+				return false;
+			v++;
+		}
+	}
+
+	*result = neg ? -v : v;
+	return true;
+}
+
+static char*
+scaled_to_str(int64 value, int scale)
+{
+	char digits[32];
+	char *result, *x;
+	uint64 mag = value < 0 ? -(uint64)value : (uint64)value;
+	int len;
+
+	snprintf(digits, sizeof(digits), UINT64_FORMAT, mag);
+	len = strlen(digits);
+
+	result = palloc(len + scale + 4);
+	x = result;
+	if (value < 0)
+		*x++ = '-';
+	if (scale == 0) {
+		strcpy(x, digits);
+		return result;
+	}
+	if (len <= scale) {
+		*x++ = '0';
+		*x++ = '.';
+		memset(x, '0', scale - len);
+		x += scale - len;
+		strcpy(x, digits);
+	}
+	else {
+		memcpy(x, digits, len - scale);
+		x += len - scale;
+		*x++ = '.';
+		strcpy(x, digits + len - scale);
+	}
+	return result;
+}
+
+static struct varlena*
+scaled_to_numeric(int64 value, int scale)
+{
+	char* str = scaled_to_str(value, scale);
+	struct varlena* numeric = (void*)OidFunctionCall3(
+		numeric_in,
+		CStringGetDatum( str ),
+		ObjectIdGetDatum( numeric_oid ),
+		Int32GetDatum( -1 )
+		);
+
+	pfree(str);
+	return numeric;
+}
+
+#ifndef HAVE_INT128
+static bool
+numeric_to_scaled(struct varlena* numeric, int scale, scale_mode mode,
+		  int64* result)
+{
+	char* str = (char*)OidFunctionCall1( numeric_out, PointerGetDatum( numeric ) );
+	bool ok = str_to_scaled(str, scale, mode, result);
+
+	pfree(str);
+	return ok;
+}
+#endif
+
+/*
+ * a multiplier as an integer and scale, keeping as many significant
+ * digits as fit in an int64: for a factor under 1 the zeros after the
+ * decimal point do not count, so small ratios keep their precision
+ */
+static void
+numeric_to_factor(struct varlena* numeric, int64* factor, int* scale)
+{
+	char* str = (char*)OidFunctionCall1( numeric_out, PointerGetDatum( numeric ) );
+	const char* p = str;
+	int int_digits = 0, zeros = 0;
+
+	if (*p == '-' || *p == '+')
+		p++;
+	while (*p == '0')
+		p++;
+	for (; *p >= '0' && *p <= '9'; p++)
+		int_digits++;
+	if (int_digits == 0 && *p == '.')
+		for (p++; *p == '0'; p++)
+			zeros++;
+
+	*scale = Min(str_scale(str), CV_MAX_SCALE - int_digits + zeros);
+	*scale = Min(*scale, CV_MAX_FACTOR_SCALE);
+	if (*scale < 0 || !str_to_scaled(str, *scale, SCALE_ROUND, factor))
+		ereport(ERROR,
+			(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			 errmsg("factor \"%s\" out of range for currency_vector", str)
+				));
+	pfree(str);
+}
+
+#ifdef HAVE_INT128
+static int64
+gcd_int64(int64 a, int64 b)
+{
+	int64 t;
+
+	if (a < 0)
+		a = -a;
+	if (b < 0)
+		b = -b;
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * a numeric as an exact fraction num / den in lowest terms (den > 0),
+ * if its digits fit in an int64 with at most CV_MAX_SCALE decimal
+ * places
+ */
+static bool
+numeric_to_fraction(struct varlena* numeric, int64* num, int64* den)
+{
+	char* str = (char*)OidFunctionCall1( numeric_out, PointerGetDatum( numeric ) );
+	int scale = str_scale(str);
+	bool ok = scale <= CV_MAX_SCALE &&
+		str_to_scaled(str, scale, SCALE_EXACT, num);
+	int64 g;
+
+	if (ok) {
+		g = gcd_int64(*num, cv_pow10[scale]);
+		*num /= g;
+		*den = cv_pow10[scale] / g;
+	}
+	pfree(str);
+	return ok;
+}
+
+/*
+ * the entry's rate as a fraction, worked out on first use so that
+ * refreshing the cache does not pay for it in every command
+ */
+static bool
+ccc_rate_fraction(ccc_ent* cc)
+{
+	if (cc->rate_den < 0 &&
+	    !numeric_to_fraction(cc->currency_rate, &cc->rate_num, &cc->rate_den))
+		cc->rate_den = 0;
+	return cc->rate_den != 0;
+}
+#endif
+
+static void
+cv_out_of_range(void)
+{
+	ereport(ERROR,
+		(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+		 errmsg("currency_vector amount out of range")
+			));
+}
+
+#ifdef HAVE_INT128
+/*
+ * dst[i] = src[i] * num / den (den > 0), with a 128-bit product so it
+ * is exact until the final division, which rounds half away from
+ * zero.  Overflow is only noted in the loop, and reported after it.
+ */
+static void
+cv_ratio_kernel(int64* dst, const int64* src, int count,
+		int64 num, int128 den)
+{
+	bool overflow = false;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		int128 p = (int128) src[i] * num;
+		int128 q = p / den;
+		int128 r = p % den;
+
+		if (2 * (r < 0 ? -r : r) >= den)
+			q += (p < 0) ? -1 : 1;
+		overflow |= (q > PG_INT64_MAX || q < PG_INT64_MIN);
+		dst[i] = (int64) q;
+	}
+	if (overflow)
+		cv_out_of_range();
+}
+#endif
+
+/* dst[i] = round(src[i] * factor / 10^scale) */
+static void
+cv_scale_kernel(int64* dst, const int64* src, int count,
+		int64 factor, int scale)
+{
+#ifdef HAVE_INT128
+	int128 den = 1;
+	int i;
+
+	for (i = 0; i < scale; i++)
+		den *= 10;
+	cv_ratio_kernel(dst, src, count, factor, den);
+#else
+	int i;
+	struct varlena *f, *a, *p;
+
+	f = scaled_to_numeric(factor, scale);
+	for (i = 0; i < count; i++) {
+		a = scaled_to_numeric(src[i], 0);
+		p = (void*)OidFunctionCall2(
+			numeric_mul, PointerGetDatum(a), PointerGetDatum(f)
+			);
+		if (!numeric_to_scaled(p, 0, SCALE_ROUND, &dst[i]))
+			cv_out_of_range();
+		pfree(a);
+		pfree(p);
+	}
+	pfree(f);
+#endif
+}
+
+/* text form: '{1.00,2.50,-3.00} EUR' */
+PG_FUNCTION_INFO_V1(currency_vector_in);
+Datum
+currency_vector_in(PG_FUNCTION_ARGS)
+{
+	char* str = PG_GETARG_CSTRING(0);
+	char *copy, *open, *close, *item, *next;
+	char code[4];
+	int count = 0, scale = 0, i, len;
+	currency_vector* v;
+
+	copy = pstrdup(str);
+	open = strchr(copy, '{');
+	close = strrchr(copy, '}');
+	if (!open || !close || close < open)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+			 errmsg("bad currency_vector value '%s'", str)
+				));
+	*close++ = '\0';
+	while (*close == ' ')
+		close++;
+	len = strlen(close);
+	while (len > 0 && close[len - 1] == ' ')
+		close[--len] = '\0';
+	if (len != 3)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+			 errmsg("bad currency code in currency_vector value '%s'", str)
+				));
+	memcpy(code, close, 4);
+
+	/*
+	 * first pass: count the amounts and find the widest scale.  Every
+	 * amount must be there, so "{}" and "{1,2,}" are rejected.
+	 */
+	for (item = open + 1; ; item = next + 1) {
+		next = item + strcspn(item, ",");
+		if (next == item)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("bad currency_vector value '%s'", str)
+					));
+		scale = Max(scale, str_scale(item));
+		count++;
+		if (!*next)
+			break;
+	}
+	if (scale > CV_MAX_SCALE)
+		ereport(ERROR,
+			(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			 errmsg("currency_vector scale may not exceed %d", CV_MAX_SCALE)
+				));
+
+	v = make_currency_vector(parse_tla(code), scale, count);
+	for (i = 0, item = open + 1; *item; item = next, i++) {
+		next = strchr(item, ',');
+		if (next)
+			*next++ = '\0';
+		else
+			next = item + strlen(item);
+		if (!str_to_scaled(item, scale, SCALE_EXACT, &v->amounts[i]))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("bad amount \"%s\" in currency_vector value", item)
+					));
+	}
+	pfree(copy);
+
+	PG_RETURN_POINTER(v);
+}
+
+PG_FUNCTION_INFO_V1(currency_vector_out);
+Datum
+currency_vector_out(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	int count = CV_COUNT(v), i;
+	StringInfoData buf;
+	char* amount;
+	char code[4];
+
+	initStringInfo(&buf);
+	appendStringInfoChar(&buf, '{');
+	for (i = 0; i < count; i++) {
+		amount = scaled_to_str(v->amounts[i], v->scale);
+		if (i)
+			appendStringInfoChar(&buf, ',');
+		appendStringInfoString(&buf, amount);
+		pfree(amount);
+	}
+	emit_tla_buf(v->currency_code, code);
+	appendStringInfo(&buf, "} %s", code);
+
+	PG_RETURN_CSTRING(buf.data);
+}
+
+/* cast from currency[]; all elements must have the same code */
+PG_FUNCTION_INFO_V1(currency_vector_from_array);
+Datum
+currency_vector_from_array(PG_FUNCTION_ARGS)
+{
+	ArrayType* array = PG_GETARG_ARRAYTYPE_P(0);
+	Datum* elems;
+	bool* nulls;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	int count, i, scale = 0;
+	char** strings;
+	currency* amount;
+	currency_vector* v;
+	int16 currency_code = 0;
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+	deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval,
+			  typalign, &elems, &nulls, &count);
+	if (count == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("cannot make a currency_vector from an empty array")
+				));
+
+	strings = palloc(sizeof(char*) * count);
+	for (i = 0; i < count; i++) {
+		struct varlena* num;
+
+		if (nulls[i])
+			ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("currency_vector cannot contain nulls")
+					));
+		amount = DatumGetCurrency(elems[i]);
+		if (i == 0)
+			currency_code = amount->currency_code;
+		else if (amount->currency_code != currency_code)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("currency_vector values must all be in one currency, not '%s' and '%s'",
+					emit_tla(currency_code),
+					emit_tla(amount->currency_code))
+					));
+		num = _currency_numeric(amount);
+		strings[i] = (char*)OidFunctionCall1( numeric_out, PointerGetDatum( num ) );
+		pfree(num);
+		scale = Max(scale, str_scale(strings[i]));
+	}
+	if (scale > CV_MAX_SCALE)
+		ereport(ERROR,
+			(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			 errmsg("currency_vector scale may not exceed %d", CV_MAX_SCALE)
+				));
+
+	v = make_currency_vector(currency_code, scale, count);
+	for (i = 0; i < count; i++) {
+		if (!str_to_scaled(strings[i], scale, SCALE_EXACT, &v->amounts[i]))
+			cv_out_of_range();
+		pfree(strings[i]);
+	}
+	pfree(strings);
+
+	PG_RETURN_POINTER(v);
+}
+
+/* cast to currency[] */
+PG_FUNCTION_INFO_V1(currency_vector_to_array);
+Datum
+currency_vector_to_array(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	Oid elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	int count = CV_COUNT(v), i;
+	Datum* elems;
+	struct varlena* num;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+
+	if (!OidIsValid(elemtype))
+		elog(ERROR, "could not determine currency type");
+
+	elems = palloc(sizeof(Datum) * count);
+	for (i = 0; i < count; i++) {
+		num = scaled_to_numeric(v->amounts[i], v->scale);
+		elems[i] = PointerGetDatum(make_currency(num, v->currency_code));
+		pfree(num);
+	}
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, count, elemtype,
+					      typlen, typbyval, typalign));
+}
+
+PG_FUNCTION_INFO_V1(currency_vector_code);
+Datum
+currency_vector_code(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+
+	PG_RETURN_DATUM(v->currency_code);
+}
+
+static Datum
+cv_result(currency_vector* v, int64 amount)
+{
+	struct varlena* num = scaled_to_numeric(amount, v->scale);
+	currency* result = make_currency(num, v->currency_code);
+
+	pfree(num);
+	return PointerGetDatum(result);
+}
+
+PG_FUNCTION_INFO_V1(currency_vector_sum);
+Datum
+currency_vector_sum(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	int count = CV_COUNT(v), i;
+	int64 hi = 0, lo = 0;
+
+	/*
+	 * sum the high and low 32 bits of the amounts separately; neither
+	 * can overflow for a vector that fits in a varlena, so the loop is
+	 * only adds, and the range is checked once afterwards
+	 */
+	for (i = 0; i < count; i++) {
+		hi += v->amounts[i] >> 32;
+		lo += v->amounts[i] & INT64CONST(0xFFFFFFFF);
+	}
+	hi += lo >> 32;
+	lo &= INT64CONST(0xFFFFFFFF);
+	if (hi < PG_INT32_MIN || hi > PG_INT32_MAX)
+		cv_out_of_range();
+
+	PG_RETURN_DATUM(cv_result(v, hi * (INT64CONST(1) << 32) + lo));
+}
+
+PG_FUNCTION_INFO_V1(currency_vector_min);
+Datum
+currency_vector_min(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	int count = CV_COUNT(v), i;
+	int64 min = PG_INT64_MAX;
+
+	if (count == 0)
+		PG_RETURN_NULL();
+	for (i = 0; i < count; i++)
+		min = v->amounts[i] < min ? v->amounts[i] : min;
+
+	PG_RETURN_DATUM(cv_result(v, min));
+}
+
+PG_FUNCTION_INFO_V1(currency_vector_max);
+Datum
+currency_vector_max(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	int count = CV_COUNT(v), i;
+	int64 max = PG_INT64_MIN;
+
+	if (count == 0)
+		PG_RETURN_NULL();
+	for (i = 0; i < count; i++)
+		max = v->amounts[i] > max ? v->amounts[i] : max;
+
+	PG_RETURN_DATUM(cv_result(v, max));
+}
+
+/* multiply every amount by a factor, rounding to the vector's scale */
+PG_FUNCTION_INFO_V1(currency_vector_mul);
+Datum
+currency_vector_mul(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	struct varlena* factor_num = (void*)PG_GETARG_POINTER(1);
+	int count = CV_COUNT(v);
+	int64 factor;
+	int scale;
+	currency_vector* result;
+
+	numeric_to_factor(factor_num, &factor, &scale);
+	result = make_currency_vector(v->currency_code, v->scale, count);
+	cv_scale_kernel(result->amounts, v->amounts, count, factor, scale);
+
+	PG_RETURN_POINTER(result);
+}
+
+/* convert every amount to another code, at the cached rates */
+PG_FUNCTION_INFO_V1(currency_vector_convert);
+Datum
+currency_vector_convert(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	int16 target_code = PG_GETARG_DATUM(1);
+	int count = CV_COUNT(v);
+	ccc_ent *cc_from, *cc_to;
+	struct varlena* factor_num;
+	int64 factor;
+	int scale;
+	currency_vector* result;
+
+	update_currency_code_cache();
+	cc_from = lookup_currency_code(v->currency_code);
+	if (!cc_from)
+		elog(ERROR, "currency code '%s' not in currency_rate table",
+		     emit_tla( v->currency_code ));
+	cc_to = lookup_currency_code(target_code);
+	if (!cc_to)
+		elog(ERROR, "currency code '%s' not in currency_rate table",
+		     emit_tla( target_code ));
+
+	result = make_currency_vector(target_code, v->scale, count);
+
+#ifdef HAVE_INT128
+	/*
+	 * with both rates exact fractions, the factor from_rate / to_rate
+	 * is (fn * td) / (fd * tn); cancelling across before multiplying
+	 * leaves it in lowest terms.  If that fits in int64s the whole
+	 * conversion is integer arithmetic and exact up to the one
+	 * rounding, half away from zero, to the vector's scale.
+	 */
+	if (ccc_rate_fraction(cc_from) && ccc_rate_fraction(cc_to) &&
+	    cc_to->rate_num) {
+		int64 g1 = gcd_int64(cc_from->rate_num, cc_to->rate_num);
+		int64 g2 = gcd_int64(cc_to->rate_den, cc_from->rate_den);
+		int128 num = (int128) (cc_from->rate_num / g1) * (cc_to->rate_den / g2);
+		int128 den = (int128) (cc_from->rate_den / g2) * (cc_to->rate_num / g1);
+
+		if (den < 0) {
+			num = -num;
+			den = -den;
+		}
+		if (num <= PG_INT64_MAX && num >= -PG_INT64_MAX && den <= PG_INT64_MAX) {
+			cv_ratio_kernel(result->amounts, v->amounts, count,
+					(int64) num, (int64) den);
+			PG_RETURN_POINTER(result);
+		}
+	}
+#endif
+
+	factor_num = (void*)OidFunctionCall2(
+		numeric_div,
+		PointerGetDatum(cc_from->currency_rate),
+		PointerGetDatum(cc_to->currency_rate)
+		);
+	numeric_to_factor(factor_num, &factor, &scale);
+	pfree(factor_num);
+
+	cv_scale_kernel(result->amounts, v->amounts, count, factor, scale);
+
+	PG_RETURN_POINTER(result);
+}
+
+/* the threshold in the vector's code, as a whole number of units */
+static int64
+cv_threshold(currency_vector* v, currency* threshold, scale_mode mode)
+{
+	struct varlena* num;
+	char* str;
+	int64 result;
+	ccc_ent *cc_from, *cc_to;
+
+	num = _currency_numeric(threshold);
+	if (threshold->currency_code != v->currency_code) {
+		struct varlena* converted;
+
+		update_currency_code_cache();
+		cc_from = lookup_currency_code(threshold->currency_code);
+		cc_to = lookup_currency_code(v->currency_code);
+		if (!cc_from || !cc_to)
+			elog(ERROR, "currency code '%s' not in currency_rate table",
+			     emit_tla( cc_from ? v->currency_code
+				       : threshold->currency_code ));
+		converted = (void*)OidFunctionCall2(
+			numeric_div,
+			OidFunctionCall2(
+				numeric_mul,
+				PointerGetDatum(num),
+				PointerGetDatum(cc_from->currency_rate)
+				),
+			PointerGetDatum(cc_to->currency_rate)
+			);
+		pfree(num);
+		num = converted;
+	}
+
+	str = (char*)OidFunctionCall1( numeric_out, PointerGetDatum( num ) );
+	if (!str_to_scaled(str, v->scale, mode, &result)) {
+		/* beyond any amount the vector can hold */
+		result = (*str == '-') ? PG_INT64_MIN : PG_INT64_MAX;
+	}
+	pfree(str);
+	pfree(num);
+	return result;
+}
+
+/* how many amounts are above (or below) a threshold */
+PG_FUNCTION_INFO_V1(currency_vector_count_above);
+Datum
+currency_vector_count_above(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	currency* threshold = PG_GETARG_CURRENCY(1);
+	int count = CV_COUNT(v), i;
+	int64 t = cv_threshold(v, threshold, SCALE_FLOOR);
+	int32 n = 0;
+
+	for (i = 0; i < count; i++)
+		n += (v->amounts[i] > t);
+
+	PG_RETURN_INT32(n);
+}
+
+PG_FUNCTION_INFO_V1(currency_vector_count_below);
+Datum
+currency_vector_count_below(PG_FUNCTION_ARGS)
+{
+	currency_vector* v = PG_GETARG_CURRENCY_VECTOR(0);
+	currency* threshold = PG_GETARG_CURRENCY(1);
+	int count = CV_COUNT(v), i;
+	int64 t = cv_threshold(v, threshold, SCALE_CEIL);
+	int32 n = 0;
+
+	for (i = 0; i < count; i++)
+		n += (v->amounts[i] < t);
+
+	PG_RETURN_INT32(n);
+}
+
+/*
+ * jsonb conversion: {"amount": 12.50, "currency": "EUR"}, built from
+ * and read into the numeric and code directly rather than through
+ * their text forms.  On input the amount may also be a string.
+ */
+static void
+jsonb_key(JsonbValue* key, char* name)
+{
+	key->type = jbvString;
+	key->val.string.val = name;
+	key->val.string.len = strlen(name);
+}
+
+static void
+bad_jsonb_currency(void)
+{
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("jsonb currency value must be an object with \"amount\" and \"currency\" keys")
+			));
+}
+
+static currency*
+jsonb_container_to_currency(JsonbContainer* container)
+{
+	JsonbValue key;
+	JsonbValue *amount, *code;
+	struct varlena* numeric = NULL;
+	char* str;
+	int16 currency_code;
+	currency* result;
+
+	if (!(container->header & JB_FOBJECT))
+		bad_jsonb_currency();
+
+	jsonb_key(&key, "amount");
+	amount = findJsonbValueFromContainer(container, JB_FOBJECT, &key);
+	jsonb_key(&key, "currency");
+	code = findJsonbValueFromContainer(container, JB_FOBJECT, &key);
+	if (!amount || !code || code->type != jbvString ||
+	    code->val.string.len != 3)
+		bad_jsonb_currency();
+
+	str = pnstrdup(code->val.string.val, code->val.string.len);
+	if (!(currency_code = parse_tla(str)))
+		elog(ERROR, "bad currency code '%s'", str);
+	pfree(str);
+
+	if (amount->type == jbvNumeric) {
+		numeric = (void*)PG_DETOAST_DATUM(NumericGetDatum(amount->val.numeric));
+	}
+	else if (amount->type == jbvString) {
+		str = pnstrdup(amount->val.string.val, amount->val.string.len);
+		numeric = (void*)OidFunctionCall3(
+			numeric_in,
+			CStringGetDatum( str ),
+			ObjectIdGetDatum( numeric_oid ),
+			Int32GetDatum( -1 )
+			);
+		/* numeric_in also takes NaN (and Infinity), which are not amounts */
+		if (numeric_is_nan((Numeric)numeric)
+#if PG_VERSION_NUM >= 140000
+		    || numeric_is_inf((Numeric)numeric)
+#endif
+			)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid currency amount \"%s\"", str)
+					));
+		pfree(str);
+	}
+	else {
+		bad_jsonb_currency();
+	}
+
+	result = make_currency(numeric, currency_code);
+	if ((Pointer)numeric != (Pointer)amount->val.numeric)
+		pfree(numeric);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(currency_to_jsonb);
+Datum
+currency_to_jsonb(PG_FUNCTION_ARGS)
+{
+	currency* amount = PG_GETARG_CURRENCY(0);
+	JsonbParseState* state = NULL;
+	JsonbValue key, val;
+	JsonbValue* res;
+	char code[4];
+
+	pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+
+	jsonb_key(&key, "amount");
+	pushJsonbValue(&state, WJB_KEY, &key);
+	val.type = jbvNumeric;
+	val.val.numeric = (Numeric)_currency_numeric(amount);
+	pushJsonbValue(&state, WJB_VALUE, &val);
+
+	jsonb_key(&key, "currency");
+	pushJsonbValue(&state, WJB_KEY, &key);
+	emit_tla_buf(amount->currency_code, code);
+	jsonb_key(&val, code);
+	pushJsonbValue(&state, WJB_VALUE, &val);
+
+	res = pushJsonbValue(&state, WJB_END_OBJECT, NULL);
+
+	PG_RETURN_JSONB_P(JsonbValueToJsonb(res));
+}
+
+PG_FUNCTION_INFO_V1(jsonb_to_currency);
+Datum
+jsonb_to_currency(PG_FUNCTION_ARGS)
+{
+	Jsonb* jb = PG_GETARG_JSONB_P(0);
+
+	PG_RETURN_POINTER(jsonb_container_to_currency(&jb->root));
+}
+
+/* a jsonb array of such objects to a currency[] */
+PG_FUNCTION_INFO_V1(jsonb_to_currency_array);
+Datum
+jsonb_to_currency_array(PG_FUNCTION_ARGS)
+{
+	Jsonb* jb = PG_GETARG_JSONB_P(0);
+	Oid elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	JsonbIterator* it;
+	JsonbValue v;
+	JsonbIteratorToken token;
+	Datum* elems;
+	int count = 0;
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+
+	if (!OidIsValid(elemtype))
+		elog(ERROR, "could not determine currency type");
+	if (!JB_ROOT_IS_ARRAY(jb) || JB_ROOT_IS_SCALAR(jb))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("jsonb_to_currency_array needs an array of currency objects")
+				));
+
+	elems = palloc(sizeof(Datum) * Max(JB_ROOT_COUNT(jb), 1));
+	it = JsonbIteratorInit(&jb->root);
+	while ((token = JsonbIteratorNext(&it, &v, true)) != WJB_DONE) {
+		if (token != WJB_ELEM)
+			continue;
+		if (v.type != jbvBinary)
+			bad_jsonb_currency();
+		elems[count++] = PointerGetDatum(
+			jsonb_container_to_currency(v.val.binary.data)
+			);
+	}
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, count, elemtype,
+					      typlen, typbyval, typalign));
+}
+
+/*
+ * currency_load(path, stop_on_error): stream "description<TAB>amount"
+ * lines, as in data/amounts.data, out of a server-side file.  The file
+ * is read in large chunks and each amount is tokenized in place, so
+ * only the number itself goes through numeric_in.  Malformed lines
+ * come back with a NULL amount, the raw line as the description and
+ * the reason in error, unless stop_on_error is set.
+ */
+#define CL_BUFSIZE 65536
+
+typedef struct currency_load_state
+{
+	FILE* file;
+	char* path;
+	bool stop_on_error;
+	int64 lineno;
+	char* buf;		/* CL_BUFSIZE + 1 for a terminator */
+	int start;		/* unconsumed bytes are buf[start..end) */
+	int end;
+	bool eof;
+	bool skipping;		/* dropping the rest of an over-long line */
+} currency_load_state;
+
+static void
+currency_load_shutdown(Datum arg)
+{
+	currency_load_state* st = (currency_load_state*)DatumGetPointer(arg);
+
+	if (st->file) {
+		FreeFile(st->file);
+		st->file = NULL;
+	}
+}
+
+/*
+ * the next line, terminated in place and without its line ending;
+ * NULL at the end of the file.  Lines which do not fit in the buffer
+ * are returned empty, with *too_long set.
+ */
+static char*
+currency_load_line(currency_load_state* st, bool* too_long)
+{
+	char *line, *nl;
+	size_t n;
+
+	*too_long = false;
+	for (;;) {
+		line = st->buf + st->start;
+		nl = memchr(line, '\n', st->end - st->start);
+		if (!nl && st->eof && (st->start < st->end || st->skipping))
+			nl = st->buf + st->end;
+		if (nl) {
+			*nl = '\0';
+			st->start = Min(nl - st->buf + 1, st->end);
+			if (st->skipping) {
+				st->skipping = false;
+				*too_long = true;
+				return nl;
+			}
+			if (nl > line && nl[-1] == '\r')
+				nl[-1] = '\0';
+			return line;
+		}
+		if (st->eof)
+			return NULL;
+
+		/* keep the partial line, and fill up the rest of the buffer */
+		memmove(st->buf, line, st->end - st->start);
+		st->end -= st->start;
+		st->start = 0;
+		if (st->end == CL_BUFSIZE) {
+			st->end = 0;
+			st->skipping = true;
+		}
+		n = fread(st->buf + st->end, 1, CL_BUFSIZE - st->end, st->file);
+		if (n == 0) {
+			if (ferror(st->file))
+				ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", st->path)
+						));
+			st->eof = true;
+		}
+		st->end += n;
+	}
+}
+
+/*
+ * split " -12.50 EUR " into the number, terminated in place, and the
+ * code; returns NULL, or the reason it could not.
+ */
+static const char*
+currency_load_amount(char* str, char** number, int16* currency_code)
+{
+	char *p = str, *num_end;
+	char code[4];
+	int digits = 0, i;
+
+	while (*p == ' ')
+		p++;
+	*number = p;
+	if (*p == '-' || *p == '+')
+		p++;
+	for (; *p >= '0' && *p <= '9'; p++)
+		digits++;
+	if (*p == '.')
+		for (p++; *p >= '0' && *p <= '9'; p++)
+			digits++;
+	if (!digits)
+		return "bad amount";
+	num_end = p;
+
+	while (*p == ' ')
+		p++;
+	if (!*p)
+		return "missing currency code";
+	for (i = 0; i < 3; i++, p++) {
+		if (*p >= 'a' && *p <= 'z')
+			code[i] = *p - 32;
+		else if (*p >= 'A' && *p <= 'Z')
+			code[i] = *p;
+		else
+			return "bad currency code";
+	}
+	while (*p == ' ')
+		p++;
+	if (*p)
+		return "bad currency code";
+
+	code[3] = '\0';
+	*num_end = '\0';
+	*currency_code = parse_tla(code);
+	return NULL;
+}
+
+PG_FUNCTION_INFO_V1(currency_load);
+Datum
+currency_load(PG_FUNCTION_ARGS)
+{
+	FuncCallContext* funcctx;
+	ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+	currency_load_state* st;
+	char* line;
+	bool too_long;
+
+	if (SRF_IS_FIRSTCALL()) {
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		st = palloc0(sizeof(currency_load_state));
+		st->path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		st->stop_on_error = PG_GETARG_BOOL(1);
+		st->buf = palloc(CL_BUFSIZE + 1);
+		st->file = AllocateFile(st->path, "r");
+		if (!st->file)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m",
+					st->path)
+					));
+
+		/* close the file if the caller stops early */
+		if (rsinfo && IsA(rsinfo, ReturnSetInfo))
+			RegisterExprContextCallback(rsinfo->econtext,
+						    currency_load_shutdown,
+						    PointerGetDatum(st));
+		funcctx->user_fctx = st;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	st = funcctx->user_fctx;
+
+	while ((line = currency_load_line(st, &too_long))) {
+		Datum values[4];
+		bool nulls[4] = { false, false, false, false };
+		char *tab = NULL, *number = NULL;
+		const char* reason;
+		int16 currency_code;
+		struct varlena* numeric;
+
+		st->lineno++;
+		if (!too_long && !*line)
+			continue;
+
+		if (too_long)
+			reason = "line too long";
+		else if (!(tab = strchr(line, '\t')))
+			reason = "missing tab";
+		else
+			reason = currency_load_amount(tab + 1, &number, &currency_code);
+
+		values[0] = Int64GetDatum(st->lineno);
+		if (reason) {
+			if (st->stop_on_error)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("%s at line " INT64_FORMAT " of \"%s\"",
+						reason, st->lineno, st->path)
+						));
+			values[1] = CStringGetTextDatum(line);
+			nulls[2] = true;
+			values[3] = CStringGetTextDatum(reason);
+		}
+		else {
+			*tab = '\0';
+			values[1] = CStringGetTextDatum(line);
+			numeric = (void*)OidFunctionCall3(
+				numeric_in,
+				CStringGetDatum( number ),
+				ObjectIdGetDatum( numeric_oid ),
+				Int32GetDatum( -1 )
+				);
+			values[2] = PointerGetDatum(make_currency((void*)numeric, currency_code));
+			pfree(numeric);
+			nulls[3] = true;
+		}
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(
+					heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	currency_load_shutdown(PointerGetDatum(st));
+	if (rsinfo && IsA(rsinfo, ReturnSetInfo))
+		UnregisterExprContextCallback(rsinfo->econtext,
+					      currency_load_shutdown,
+					      PointerGetDatum(st));
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Sketch aggregates over neutral values: approx_percentile() as a
+ * merging t-digest, and approx_count_distinct() as a HyperLogLog.
+ * Both take one pass and fixed memory, and have combine, serial and
+ * deserial functions for partial and parallel aggregation.
+ */
+#define float8_numeric 1743
+
+/* neutral value of a currency, as a float8 */
+static double
+currency_neutral_float8(currency* amount)
+{
+	struct varlena* neutral = currency_neutral(amount);
+	double result = DatumGetFloat8(OidFunctionCall1(
+		numeric_float8, PointerGetDatum( neutral )
+		));
+
+	pfree(neutral);
+	return result;
+}
+
+static MemoryContext
+sketch_context(FunctionCallInfo fcinfo, const char* fn)
+{
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "%s called in non-aggregate context", fn);
+	return aggcontext;
+}
+
+/*
+ * t-digest: centroids (mean, weight) kept sorted by mean, with new
+ * points appended unsorted after them until the array is full; then
+ * everything is sorted and adjacent centroids merged while the
+ * weight stays under 4 N q (1 - q) / TD_COMPRESSION, q being the
+ * centroid's quantile.  That keeps the tails nearly exact.  Should
+ * that leave the array full, neighbouring centroids are merged in
+ * pairs regardless, so there is always room for the next point.
+ */
+#define TD_COMPRESSION 100
+#define TD_CAPACITY 1024
+
+typedef struct td_centroid
+{
+	double mean;
+	double weight;
+} td_centroid;
+
+typedef struct tdigest
+{
+	double fraction;	/* percentile wanted, from the first row */
+	double total;		/* weight of all centroids and points */
+	double min;
+	double max;
+	int nmerged;		/* sorted centroids */
+	int n;			/* centroids plus unsorted points */
+	td_centroid c[TD_CAPACITY];
+} tdigest;
+
+static int
+td_centroid_cmp(const void* a, const void* b)
+{
+	double x = ((const td_centroid*)a)->mean;
+	double y = ((const td_centroid*)b)->mean;
+
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static void
+td_compress(tdigest* td)
+{
+	double sofar = 0, q, limit;
+	int i, out = 0;
+
+	if (td->n == td->nmerged && td->n < TD_CAPACITY)
+		return;
+	qsort(td->c, td->n, sizeof(td_centroid), td_centroid_cmp);
+
+	for (i = 1; i < td->n; i++) {
+		td_centroid* cur = &td->c[out];
+		td_centroid* next = &td->c[i];
+
+		q = (sofar + (cur->weight + next->weight) / 2) / td->total;
+		limit = 4 * td->total * q * (1 - q) / TD_COMPRESSION;
+		if (cur->weight + next->weight <= limit) {
+			cur->mean += (next->mean - cur->mean) * next->weight /
+				(cur->weight + next->weight);
+			cur->weight += next->weight;
+		}
+		else {
+			sofar += cur->weight;
+			td->c[++out] = *next;
+		}
+	}
+	td->n = td->nmerged = out + 1;
+
+	if (td->n == TD_CAPACITY) {
+		int half = td->n / 2;
+
+		for (i = 0; i < half; i++) {
+			td_centroid* a = &td->c[2 * i];
+			td_centroid* b = &td->c[2 * i + 1];
+
+			td->c[i].mean = a->mean + (b->mean - a->mean) * b->weight /
+				(a->weight + b->weight);
+			td->c[i].weight = a->weight + b->weight;
+		}
+		/* an odd one out is kept as it is */
+		if (td->n % 2)
+			td->c[half] = td->c[td->n - 1];
+		td->n = td->nmerged = td->n - half;
+	}
+}
+
+/*
+ * a copy of the used part of a digest, so that the final and serial
+ * functions can compress it without changing the aggregate's state
+ */
+static tdigest*
+td_copy(tdigest* td)
+{
+	tdigest* copy = palloc(sizeof(tdigest));
+
+	memcpy(copy, td, offsetof(tdigest, c) + sizeof(td_centroid) * td->n);
+	return copy;
+}
+
+static void
+td_add(tdigest* td, double mean, double weight)
+{
+	if (td->n == TD_CAPACITY)
+		td_compress(td);
+	Assert(td->n < TD_CAPACITY);
+	if (td->total == 0 || mean < td->min)
+		td->min = mean;
+	if (td->total == 0 || mean > td->max)
+		td->max = mean;
+	td->c[td->n].mean = mean;
+	td->c[td->n].weight = weight;
+	td->n++;
+	td->total += weight;
+}
+
+static double
+td_quantile(tdigest* td, double fraction)
+{
+	double target = fraction * td->total;
+	double cum = 0, left, right;
+	td_centroid* c = td->c;
+	int i, last;
+
+	td_compress(td);
+	last = td->n - 1;
+	if (last == 0)
+		return c[0].mean;
+
+	/* between the minimum and the middle of the first centroid */
+	if (target <= c[0].weight / 2)
+		return td->min + (c[0].mean - td->min) *
+			target / (c[0].weight / 2);
+
+	for (i = 0; i < last; i++) {
+		left = cum + c[i].weight / 2;
+		right = cum + c[i].weight + c[i + 1].weight / 2;
+		if (target <= right)
+			return c[i].mean + (c[i + 1].mean - c[i].mean) *
+				(target - left) / (right - left);
+		cum += c[i].weight;
+	}
+
+	/* between the middle of the last centroid and the maximum */
+	return td->max - (td->max - c[last].mean) *
+		(td->total - target) / (c[last].weight / 2);
+}
+
+PG_FUNCTION_INFO_V1(approx_percentile_accum);
+Datum
+approx_percentile_accum(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext = sketch_context(fcinfo, "approx_percentile_accum");
+	tdigest* td = PG_ARGISNULL(0) ? NULL : (tdigest*)PG_GETARG_POINTER(0);
+	currency* amount;
+	double fraction;
+
+	if (!td) {
+		if (PG_ARGISNULL(2))
+			PG_RETURN_NULL();
+		fraction = PG_GETARG_FLOAT8(2);
+		if (fraction < 0 || fraction > 1 || isnan(fraction))
+			ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("percentile value %g is not between 0 and 1",
+					fraction)
+					));
+		td = MemoryContextAllocZero(aggcontext, sizeof(tdigest));
+		td->fraction = fraction;
+	}
+	else if (PG_ARGISNULL(2) || PG_GETARG_FLOAT8(2) != td->fraction)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("percentile value must be the same for all rows")
+				));
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(td);
+
+	amount = PG_GETARG_CURRENCY(1);
+	update_currency_code_cache();
+	td_add(td, currency_neutral_float8(amount), 1);
+	PG_FREE_CURRENCY_IF_COPY(amount, 1);
+
+	PG_RETURN_POINTER(td);
+}
+
+PG_FUNCTION_INFO_V1(approx_percentile_combine);
+Datum
+approx_percentile_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext = sketch_context(fcinfo, "approx_percentile_combine");
+	tdigest* a = PG_ARGISNULL(0) ? NULL : (tdigest*)PG_GETARG_POINTER(0);
+	tdigest* b = PG_ARGISNULL(1) ? NULL : (tdigest*)PG_GETARG_POINTER(1);
+	double min, max;
+	int i;
+
+	if (!b)
+		PG_RETURN_POINTER(a);
+	if (!a) {
+		a = MemoryContextAlloc(aggcontext, sizeof(tdigest));
+		memcpy(a, b, sizeof(tdigest));
+		PG_RETURN_POINTER(a);
+	}
+
+	if (b->total > 0) {
+		min = (a->total > 0) ? Min(a->min, b->min) : b->min;
+		max = (a->total > 0) ? Max(a->max, b->max) : b->max;
+		for (i = 0; i < b->n; i++)
+			td_add(a, b->c[i].mean, b->c[i].weight);
+		a->min = min;
+		a->max = max;
+	}
+	PG_RETURN_POINTER(a);
+}
+
+PG_FUNCTION_INFO_V1(approx_percentile_serial);
+Datum
+approx_percentile_serial(PG_FUNCTION_ARGS)
+{
+	tdigest* td = td_copy((tdigest*)PG_GETARG_POINTER(0));
+	Size size;
+	bytea* result;
+
+	td_compress(td);
+	size = offsetof(tdigest, c) + sizeof(td_centroid) * td->n;
+	result = palloc(VARHDRSZ + size);
+	SET_VARSIZE(result, VARHDRSZ + size);
+	memcpy(VARDATA(result), td, size);
+	pfree(td);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(approx_percentile_deserial);
+Datum
+approx_percentile_deserial(PG_FUNCTION_ARGS)
+{
+	bytea* state = PG_GETARG_BYTEA_PP(0);
+	Size size = VARSIZE_ANY_EXHDR(state);
+	tdigest* td = palloc0(sizeof(tdigest));
+
+	if (size >= offsetof(tdigest, c))
+		memcpy(td, VARDATA_ANY(state), offsetof(tdigest, c));
+	if (size < offsetof(tdigest, c) ||
+	    td->n < 0 || td->n > TD_CAPACITY ||
+	    td->nmerged < 0 || td->nmerged > td->n ||
+	    size != offsetof(tdigest, c) + sizeof(td_centroid) * td->n)
+		elog(ERROR, "invalid approx_percentile state");
+	memcpy(td->c, VARDATA_ANY(state) + offsetof(tdigest, c),
+	       sizeof(td_centroid) * td->n);
+
+	PG_RETURN_POINTER(td);
+}
+
+/* the estimate, in the exchange currency at its minor unit */
+PG_FUNCTION_INFO_V1(approx_percentile_final);
+Datum
+approx_percentile_final(PG_FUNCTION_ARGS)
+{
+	tdigest* td = PG_ARGISNULL(0) ? NULL : (tdigest*)PG_GETARG_POINTER(0);
+	struct varlena *numeric, *rounded;
+	currency* result;
+
+	if (!td || td->total == 0)
+		PG_RETURN_NULL();
+
+	update_currency_code_cache();
+	td = td_copy(td);
+	numeric = (void*)OidFunctionCall1(
+		float8_numeric,
+		Float8GetDatum( td_quantile(td, td->fraction) )
+		);
+	pfree(td);
+	rounded = (void*)OidFunctionCall2(
+		numeric_round_scale,
+		PointerGetDatum( numeric ),
+		Int32GetDatum( currency_code_cache[0].currency_minor )
+		);
+	result = make_currency((void*)rounded, currency_code_cache[0].currency_code);
+	pfree(numeric);
+	pfree(rounded);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * HyperLogLog over hash_numeric of the neutral value, so amounts
+ * which compare equal count once whatever their code or scale.
+ */
+#define HLL_BITS 14
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+typedef struct hll
+{
+	uint8 registers[HLL_REGISTERS];
+} hll;
+
+PG_FUNCTION_INFO_V1(approx_count_distinct_accum);
+Datum
+approx_count_distinct_accum(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext = sketch_context(fcinfo, "approx_count_distinct_accum");
+	hll* state = PG_ARGISNULL(0) ? NULL : (hll*)PG_GETARG_POINTER(0);
+	currency* amount;
+	struct varlena* neutral;
+	uint32 hash, rest;
+	uint8 rank;
+
+	if (!state)
+		state = MemoryContextAllocZero(aggcontext, sizeof(hll));
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	amount = PG_GETARG_CURRENCY(1);
+	update_currency_code_cache();
+	neutral = currency_neutral(amount);
+	hash = DatumGetUInt32(OidFunctionCall1(hash_numeric, PointerGetDatum(neutral)));
+	pfree(neutral);
+	PG_FREE_CURRENCY_IF_COPY(amount, 1);
+
+	/* the top bits pick the register; it keeps the longest run of
+	 * leading zeros seen in the rest, plus one */
+	rest = hash << HLL_BITS;
+	for (rank = 1; rank <= 32 - HLL_BITS && !(rest & 0x80000000); rank++)
+		rest <<= 1;
+	if (rank > state->registers[hash >> (32 - HLL_BITS)])
+		state->registers[hash >> (32 - HLL_BITS)] = rank;
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(approx_count_distinct_combine);
+Datum
+approx_count_distinct_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext = sketch_context(fcinfo, "approx_count_distinct_combine");
+	hll* a = PG_ARGISNULL(0) ? NULL : (hll*)PG_GETARG_POINTER(0);
+	hll* b = PG_ARGISNULL(1) ? NULL : (hll*)PG_GETARG_POINTER(1);
+	int i;
+
+	if (!b)
+		PG_RETURN_POINTER(a);
+	if (!a) {
+		a = MemoryContextAlloc(aggcontext, sizeof(hll));
+		memcpy(a, b, sizeof(hll));
+		PG_RETURN_POINTER(a);
+	}
+	for (i = 0; i < HLL_REGISTERS; i++)
+		a->registers[i] = Max(a->registers[i], b->registers[i]);
+
+	PG_RETURN_POINTER(a);
+}
+
+PG_FUNCTION_INFO_V1(approx_count_distinct_serial);
+Datum
+approx_count_distinct_serial(PG_FUNCTION_ARGS)
+{
+	hll* state = (hll*)PG_GETARG_POINTER(0);
+	bytea* result = palloc(VARHDRSZ + sizeof(hll));
+
+	SET_VARSIZE(result, VARHDRSZ + sizeof(hll));
+	memcpy(VARDATA(result), state, sizeof(hll));
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(approx_count_distinct_deserial);
+Datum
+approx_count_distinct_deserial(PG_FUNCTION_ARGS)
+{
+	bytea* bytes = PG_GETARG_BYTEA_PP(0);
+	hll* state = palloc(sizeof(hll));
+
+	if (VARSIZE_ANY_EXHDR(bytes) != sizeof(hll))
+		elog(ERROR, "invalid approx_count_distinct state");
+	memcpy(state, VARDATA_ANY(bytes), sizeof(hll));
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(approx_count_distinct_final);
+Datum
+approx_count_distinct_final(PG_FUNCTION_ARGS)
+{
+	hll* state = PG_ARGISNULL(0) ? NULL : (hll*)PG_GETARG_POINTER(0);
+	double m = HLL_REGISTERS;
+	double sum = 0, estimate;
+	int i, zeros = 0;
+
+	if (!state)
+		PG_RETURN_INT64(0);
+
+	for (i = 0; i < HLL_REGISTERS; i++) {
+		sum += ldexp(1.0, -state->registers[i]);
+		if (!state->registers[i])
+			zeros++;
+	}
+	estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+	/* small and large range corrections, for a 32-bit hash */
+	if (estimate <= 2.5 * m && zeros)
+		estimate = m * log(m / zeros);
+	else if (estimate > 4294967296.0 / 30)
+		estimate = -4294967296.0 * log(1 - estimate / 4294967296.0);
+
+	PG_RETURN_INT64((int64)rint(estimate));
+}
@@ -0,0 +1,481 @@
+/*
+ * Background worker which applies exchange rates from a feed file
+ *
+ * contrib/currency/rate_feed.c
+ */
+
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fmgr.h"
+
+#include "tla.h"
+#include "rate_feed.h"
+
+/*
+ * The feed is a tab-separated file shaped like data/iso4217.data,
+ * with the rate as an extra, last column:
+ *
+ *   EUR<TAB>978<TAB>2<TAB>Euro<TAB>6.0125
+ *
+ * Only the first (code) and last (rate) columns are read;
+ * currency_rate_feed_parse() shows what would be read from a file.
+ * The worker looks at the file every currency.rate_feed_naptime
+ * milliseconds, and if it has changed since it was last applied
+ * (by modification time, size or inode), updates every
+ * currency_rate row whose rate differs in one statement.  Any number
+ * of rewrites of the file between two looks are applied as one batch.
+ * Writers should replace the file atomically (write and rename).
+ * Lines without a valid code and a rate greater than zero are logged
+ * and skipped; a file which still fails to apply is logged once, and
+ * tried again only after it changes.
+ *
+ * The worker is only started when the module is in
+ * shared_preload_libraries and currency.rate_feed is set.
+ */
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/miscnodes.h"
+#endif
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/fd.h"
+#include "storage/proc.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/numeric.h"
+#include "utils/snapmgr.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+PGDLLEXPORT void currency_rate_feed_main(Datum main_arg);
+
+static char* rate_feed_path = NULL;
+static char* rate_feed_database = NULL;
+static int rate_feed_naptime = 1000;
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static void
+rate_feed_sighup(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+static void
+rate_feed_sigterm(SIGNAL_ARGS)
+{
+	int save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+	errno = save_errno;
+}
+
+/* is str a plausible currency code?  (the UPDATE casts it) */
+static bool
+valid_feed_code(char* str)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!((str[i] >= 'A' && str[i] <= 'Z') ||
+		      (str[i] >= 'a' && str[i] <= 'z')))
+			return false;
+	}
+	return str[3] == '\0';
+}
+
+/*
+ * the rate as a NUMERIC, or NULL unless it is a number greater than
+ * zero; a rate of zero would make every conversion into its code
+ * divide by zero
+ */
+static Numeric
+parse_feed_rate(char* str)
+{
+	Datum rate = 0;
+#if PG_VERSION_NUM >= 160000
+	ErrorSaveContext escontext = { T_ErrorSaveContext };
+
+	if (!DirectInputFunctionCallSafe(numeric_in, str, InvalidOid, -1,
+					 (Node*)&escontext, &rate))
+		return NULL;
+#else
+	MemoryContext oldcontext = CurrentMemoryContext;
+	volatile bool ok = true;
+
+	/* numeric_in has no side effects to undo */
+	PG_TRY();
+	{
+		rate = DirectFunctionCall3(
+			numeric_in,
+			CStringGetDatum(str),
+			ObjectIdGetDatum(InvalidOid),
+			Int32GetDatum(-1)
+			);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		FlushErrorState();
+		ok = false;
+	}
+	PG_END_TRY();
+	if (!ok)
+		return NULL;
+#endif
+
+	if (numeric_is_nan(DatumGetNumeric(rate))
+#if PG_VERSION_NUM >= 140000
+	    || numeric_is_inf(DatumGetNumeric(rate))
+#endif
+	    || !DatumGetBool(DirectFunctionCall2(
+				     numeric_gt, rate,
+				     DirectFunctionCall1(int4_numeric, Int32GetDatum(0))
+				     )))
+		return NULL;
+	return DatumGetNumeric(rate);
+}
+
+/* a rate read from the feed */
+typedef struct feed_rate
+{
+	char code[4];		/* upper case */
+	Numeric rate;
+} feed_rate;
+
+/*
+ * read the rates in an open feed file into a List of feed_rate;
+ * lines which cannot be used are reported at elevel and skipped.  If
+ * a code appears more than once, its last rate is kept.
+ */
+static List*
+read_rate_feed(FILE* feed, const char* path, int elevel)
+{
+	char line[1024];
+	char *code, *rate, *tab;
+	int lineno = 0, i;
+	Numeric rate_num;
+	feed_rate* fr;
+	ListCell* lc;
+	List* rates = NIL;
+
+	while (fgets(line, sizeof(line), feed)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!*line || *line == '#')
+			continue;
+
+		code = line;
+		rate = strrchr(line, '\t');
+		tab = strchr(line, '\t');
+		if (!rate || !tab) {
+			ereport(elevel,
+				(errmsg("currency rate feed \"%s\" line %d: expected tab-separated code and rate",
+					path, lineno)));
+			continue;
+		}
+		*tab = '\0';
+		rate++;
+		if (!valid_feed_code(code) || !(rate_num = parse_feed_rate(rate))) {
+			ereport(elevel,
+				(errmsg("currency rate feed \"%s\" line %d: bad code or rate",
+					path, lineno)));
+			continue;
+		}
+		for (i = 0; i < 3; i++)
+			code[i] = pg_toupper((unsigned char) code[i]);
+
+		foreach(lc, rates) {
+			fr = lfirst(lc);
+			if (strcmp(fr->code, code) == 0)
+				break;
+		}
+		if (lc) {
+			ereport(elevel,
+				(errmsg("currency rate feed \"%s\" line %d: %s repeated, using this rate",
+					path, lineno, code)));
+			fr->rate = rate_num;
+			continue;
+		}
+
+		fr = palloc(sizeof(feed_rate));
+		strcpy(fr->code, code);
+		fr->rate = rate_num;
+		rates = lappend(rates, fr);
+	}
+
+	return rates;
+}
+
+/* build an UPDATE of all the rates read */
+static void
+build_rate_update(List* rates, StringInfo sql)
+{
+	ListCell* lc;
+
+	appendStringInfoString(
+		sql,
+		"UPDATE currency_rate r SET rate = v.rate FROM (VALUES "
+		);
+
+	foreach(lc, rates) {
+		feed_rate* fr = lfirst(lc);
+
+		appendStringInfo(sql, "%s(%s::tla, %s::numeric)",
+				 lc == list_head(rates) ? "" : ", ",
+				 quote_literal_cstr(fr->code),
+				 quote_literal_cstr(DatumGetCString(DirectFunctionCall1(
+					 numeric_out, NumericGetDatum(fr->rate)))));
+	}
+
+	/* only touch rows which actually change; the exchange currency
+	 * is always 1 */
+	appendStringInfoString(
+		sql,
+		") v(code, rate)"
+		" WHERE r.code = v.code"
+		" AND r.rate <> v.rate"
+		" AND NOT r.is_exchange"
+		);
+}
+
+static void
+apply_rate_feed(void)
+{
+	StringInfoData sql;
+	FILE* feed;
+	List* rates = NIL;
+	int ret;
+
+	initStringInfo(&sql);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	feed = AllocateFile(rate_feed_path, "r");
+	if (!feed)
+		ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not open currency rate feed \"%s\": %m",
+				rate_feed_path)));
+	else {
+		rates = read_rate_feed(feed, rate_feed_path, LOG);
+		FreeFile(feed);
+	}
+
+	if (rates != NIL) {
+		build_rate_update(rates, &sql);
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "applying currency rate feed");
+
+		ret = SPI_execute(sql.data, false, 0);
+		if (ret != SPI_OK_UPDATE)
+			elog(ERROR, "failed to apply currency rate feed: %d", ret);
+		elog(DEBUG1, "currency rate feed: updated %lu rates",
+		     (unsigned long) SPI_processed);
+
+		SPI_finish();
+		PopActiveSnapshot();
+	}
+
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+	pfree(sql.data);
+}
+
+void
+currency_rate_feed_main(Datum main_arg)
+{
+	struct stat st;
+	struct timespec last_mtim = { 0, 0 };
+	off_t last_size = -1;
+	ino_t last_ino = 0;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	int rc;
+
+	pqsignal(SIGHUP, rate_feed_sighup);
+	pqsignal(SIGTERM, rate_feed_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(rate_feed_database, NULL, 0);
+
+	while (!got_sigterm) {
+		rc = WaitLatch(MyLatch,
+			       WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+			       rate_feed_naptime,
+			       PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup) {
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+			last_size = -1;	/* maybe a different file now */
+		}
+
+		if (!rate_feed_path || !*rate_feed_path)
+			continue;
+		if (stat(rate_feed_path, &st) != 0)
+			continue;
+		/* a file renamed into place has a new inode, even if it
+		 * matches the old one to the timestamp resolution */
+		if (st.st_mtim.tv_sec == last_mtim.tv_sec &&
+		    st.st_mtim.tv_nsec == last_mtim.tv_nsec &&
+		    st.st_size == last_size && st.st_ino == last_ino)
+			continue;
+
+		last_mtim = st.st_mtim;
+		last_size = st.st_size;
+		last_ino = st.st_ino;
+
+		/*
+		 * a file that cannot be applied is logged and then left
+		 * until it changes, rather than exiting the worker and
+		 * trying the same file again on every restart
+		 */
+		PG_TRY();
+		{
+			apply_rate_feed();
+		}
+		PG_CATCH();
+		{
+			EmitErrorReport();
+			FlushErrorState();
+			AbortCurrentTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			pgstat_report_activity(STATE_IDLE, NULL);
+		}
+		PG_END_TRY();
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * the rates a feed file would apply, as (code, rate) rows, for
+ * checking a file before pointing currency.rate_feed at it
+ */
+PG_FUNCTION_INFO_V1(currency_rate_feed_parse);
+Datum
+currency_rate_feed_parse(PG_FUNCTION_ARGS)
+{
+	FuncCallContext* funcctx;
+
+	if (SRF_IS_FIRSTCALL()) {
+		MemoryContext oldcontext;
+		TupleDesc tupdesc;
+		char* path;
+		FILE* feed;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		feed = AllocateFile(path, "r");
+		if (!feed)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open currency rate feed \"%s\": %m",
+					path)));
+		funcctx->user_fctx = read_rate_feed(feed, path, WARNING);
+		FreeFile(feed);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < list_length(funcctx->user_fctx)) {
+		feed_rate* fr = list_nth(funcctx->user_fctx, funcctx->call_cntr);
+		Datum values[2];
+		bool nulls[2] = { false, false };
+
+		values[0] = Int16GetDatum(parse_tla(fr->code));
+		values[1] = NumericGetDatum(fr->rate);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(
+			heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+void
+currency_rate_feed_init(void)
+{
+	BackgroundWorker worker;
+
+	DefineCustomStringVariable(
+		"currency.rate_feed",
+		"Tab-separated exchange rate feed file to apply to currency_rate.",
+		NULL,
+		&rate_feed_path,
+		"",
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL
+		);
+	DefineCustomStringVariable(
+		"currency.rate_feed_database",
+		"Database whose currency_rate the rate feed updates.",
+		NULL,
+		&rate_feed_database,
+		"postgres",
+		PGC_POSTMASTER,
+		0,
+		NULL, NULL, NULL
+		);
+	DefineCustomIntVariable(
+		"currency.rate_feed_naptime",
+		"How often to check the rate feed for changes.",
+		NULL,
+		&rate_feed_naptime,
+		1000,
+		10,
+		INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_MS,
+		NULL, NULL, NULL
+		);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+	if (!rate_feed_path || !*rate_feed_path)
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "currency");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "currency_rate_feed_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "currency rate feed");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "currency rate feed");
+	RegisterBackgroundWorker(&worker);
+}
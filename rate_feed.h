@@ -0,0 +1 @@
+void currency_rate_feed_init(void);
@@ -129,3 +129,236 @@ select +'60 usd'::currency as "60 USD";
 
 select '20 usd'::currency + -'60 usd'::currency as "-40 USD";
 select '20 usd'::currency + +'60 usd'::currency as "80 USD";
+
+-- aggregates
+select sum(x) as "30 USD" from (select '10 usd'::currency as x union all select '20 usd'::currency) s;
+select sum(x) as "60 BTC" from (select '10 usd'::currency as x union all select '20 btc'::currency) s;
+select n, sum(x) over (order by n rows 1 preceding) from (values (1, '10 usd'::currency), (2, '20 usd'), (3, '5 nzd')) v(n, x) order by n;
+
+-- formatting with grouping and decimal separators
+update currency_rate set group_sep = '.', decimal_sep = ',' where code = 'EUR';
+select #('1234567.891 eur'::currency) as "€ 1.234.567,89";
+select #('-999 eur'::currency) as "€ -999,00";
+update currency_rate set group_sep = null, decimal_sep = null where code = 'EUR';
+
+-- native ordering and ranges
+select '100 eur'::currency #<# '1 usd'::currency as t;
+select '100 eur'::currency #=# '100.00 eur'::currency as t;
+select '40 eur'::currency #=# '60 usd'::currency as f;
+select '["10 eur","20 eur"]'::currencyrange @> '15 eur'::currency as t;
+select '["10 eur","20 eur"]'::currencyrange @> '15 usd'::currency as f;
+select count(*) from currency_band('60 usd', '120 usd') b where b @> '100 nzd'::currency;
+select count(*) from currency_band('60 usd', '120 usd') b where b @> '200 nzd'::currency;
+-- a band searched by its bounds, with a native order index
+create table items (id int, price currency);
+create index on items (price currency_native_ops);
+insert into items select i, (i % 200 || ' nzd')::currency from generate_series(1, 2000) i;
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+explain (costs off) select id from items where price #>=# '80 nzd' and price #<=# '160 nzd';
+reset enable_seqscan;
+reset enable_bitmapscan;
+select count(*) from items join currency_band('60 usd', '120 usd') b on items.price #>=# lower(b) and items.price #<=# upper(b);
+drop table items;
+
+-- conversion over pair quotes
+insert into currency_pair_rate values ('EUR', 'USD', 1.10, 1.12), ('USD', 'NZD', 1.60, 1.70);
+select change('100 eur'::currency, 'nzd', 'bid') as "176.0000 NZD";
+select change('100 eur'::currency, 'nzd', 'ask') as "190.4000 NZD";
+select compare('176 nzd'::currency, '100 eur'::currency, 'bid') as "0";
+select change('100 eur'::currency, 'gbp', 'bid') as ERROR;
+update currency_pair_rate set bid = 1.20, ask = 1.22 where base = 'EUR';
+select change('100 eur'::currency, 'nzd', 'bid') as "192.0000 NZD";
+-- a cycle is only reported by the functions that use the quotes
+insert into currency_pair_rate values ('NZD', 'EUR', 0.6, 0.6);
+select '100 eur'::currency = '200 nzd'::currency as t;
+select change('100 eur'::currency, 'nzd', 'bid') as ERROR;
+delete from currency_pair_rate;
+
+-- benchmarking entry point
+select ns_per_op > 0 as t, cache_refreshes from currency_bench('currency_cmp', 100, array['100 eur', '60 usd']::currency[]);
+select ns_per_op > 0 as t from currency_bench('parse_currency', 100, array['100 eur']::currency[]);
+select alloc_bytes_per_op as "0" from currency_bench('parse_tla', 100, array['100 eur']::currency[]);
+select alloc_bytes_per_op > 0 as t from currency_bench('parse_currency', 100, array['100 eur']::currency[]);
+select * from currency_bench('numeric_mul', 100, array['100 eur']::currency[]);
+
+-- currency vectors
+select '{1.00,2.50,-3} eur'::currency_vector as "{1.00,2.50,-3.00} EUR";
+select vector_sum('{1.00,2.50,-3} eur'::currency_vector) as "0.50 EUR";
+select vector_min('{1.00,2.50,-3} eur'::currency_vector) as "-3.00 EUR";
+select vector_max('{1.00,2.50,-3} eur'::currency_vector) as "2.50 EUR";
+select array['1 eur', '2.5 eur']::currency[]::currency_vector as "{1.0,2.5} EUR";
+select array['1 eur', '2.5 nzd']::currency[]::currency_vector as ERROR;
+select '{1.0,2.5} eur'::currency_vector::currency[] as "{1.0 EUR,2.5 EUR}";
+select '{10.00,20.00} nzd'::currency_vector * 1.5 as "{15.00,30.00} NZD";
+select '{10.00,20.00} nzd'::currency_vector -> 'btc' as "{30.00,60.00} BTC";
+select vector_count_above('{10.00,20.00} nzd'::currency_vector, '15 nzd') as "1";
+select vector_count_below('{10.00,20.00} nzd'::currency_vector, '30 btc') as "0";
+select '{9000000000000000000} usd'::currency_vector * 0.000000000001234567890123456789 as "{11111111} USD";
+select vector_sum('{9000000000000000000,9000000000000000000} usd'::currency_vector) as ERROR;
+select vector_sum('{4611686018427387904,4611686018427387903} usd'::currency_vector) as "9223372036854775807 USD";
+select '{} usd'::currency_vector as ERROR;
+select '{1,2,} usd'::currency_vector as ERROR;
+
+-- native hashing and partitioning
+select hash_currency_native('100 eur') = hash_currency_native('100.00 eur') as t;
+select hash_currency_native('40 eur') != hash_currency_native('60 usd') as t;
+select hash_currency_native_extended('100 eur', 1) = hash_currency_native_extended('100.00 eur', 1) as t;
+select (hash_currency_native_extended('100 eur', 0) & 4294967295) = (hash_currency_native('100 eur') & 4294967295) as t;
+create table ledger (amount currency) partition by hash (amount currency_native_ops);
+create table ledger_0 partition of ledger for values with (modulus 2, remainder 0);
+create table ledger_1 partition of ledger for values with (modulus 2, remainder 1);
+insert into ledger values ('10 eur'), ('10.00 eur'), ('20 usd');
+select count(*), count(distinct tableoid) from ledger where amount #=# '10 eur';
+drop table ledger;
+create table ledger (amount currency) partition by list (code(amount));
+create table ledger_eur partition of ledger for values in ('EUR');
+create table ledger_usd partition of ledger for values in ('USD');
+insert into ledger values ('10 eur'), ('10.00 eur'), ('20 usd');
+select count(*) from ledger_eur;
+drop table ledger;
+
+-- jsonb conversion
+select '12.50 eur'::currency::jsonb as json;
+select '{"amount": "12.50", "currency": "eur"}'::jsonb::currency as "12.50 EUR";
+select '{"amount": 3, "currency": "NZD"}'::jsonb::currency as "3 NZD";
+select '-0.5 btc'::currency::jsonb::currency as "-0.5 BTC";
+select jsonb_to_currency_array('[{"amount": 1, "currency": "EUR"}, {"amount": "2.5", "currency": "USD"}]') as "{1 EUR,2.5 USD}";
+select '{"amount": 1}'::jsonb::currency as ERROR;
+select '{"amount": "NaN", "currency": "EUR"}'::jsonb::currency as ERROR;
+
+-- bounded neutral scale
+set currency.neutral_scale = 2;
+select '1 usd'::currency->'eur' as "0.67 EUR";
+select '2.5 eur'::currency + '1 nzd'::currency as "18.00 BTC";
+select '10 nzd'::currency / 3 as "3.33 NZD";
+select sum(x) as "7.33 BTC" from (values ('0.333 usd'::currency), ('1 eur')) v(x);
+update currency_rate set neutral_scale = 4 where code = 'EUR';
+select '1 usd'::currency->'eur' as "0.6667 EUR";
+update currency_rate set neutral_scale = null where code = 'EUR';
+reset currency.neutral_scale;
+select '1 usd'::currency->'eur' as "0.66666666666666666667 EUR";
+
+-- neutral comparisons served by a code and amount index
+create table listings (price currency);
+create index on listings (code(price), value(price));
+insert into listings values ('10 usd'), ('30 usd'), ('20 eur'), ('5 nzd'), ('100 nzd');
+insert into listings select null from generate_series(1, 1000);
+select count(*) from listings where price > '20 usd';
+select count(*) from listings where '20 usd' < price;
+select count(*) from listings where price = '20 eur';
+-- the plan has an index condition for each code
+create function plan_lines(query text, pattern text) returns setof text language plpgsql as $$
+declare
+	line text;
+begin
+	for line in execute 'explain (costs off) ' || query loop
+		if line ~ pattern then
+			return next btrim(line);
+		end if;
+	end loop;
+end
+$$;
+set enable_seqscan = off;
+select * from plan_lines('select count(*) from listings where price > ''20 usd''', '^\s*Index Cond: \(\(code\(price\) = ''USD''');
+create table ledger_p (price currency) partition by list (code(price));
+create table ledger_p_usd partition of ledger_p for values in ('USD');
+create table ledger_p_other partition of ledger_p default;
+create index on ledger_p (code(price), value(price));
+select count(*) > 0 as t from plan_lines('select count(*) from ledger_p where price > ''20 usd''', '^\s*Index Cond: \(\(code\(price\) = ''USD''');
+reset enable_seqscan;
+drop table ledger_p;
+drop function plan_lines(text, text);
+-- a table of one block is left alone
+create table listings_few (price currency);
+create index on listings_few (code(price), value(price));
+insert into listings_few values ('10 usd'), ('30 usd');
+explain (costs off) select count(*) from listings_few where price > '20 usd';
+drop table listings_few;
+prepare cheap as select count(*) from listings where price <= '15 usd';
+execute cheap;
+update currency_rate set rate = 0.5 where code = 'NZD';
+execute cheap;
+update currency_rate set rate = 3 where code = 'NZD';
+deallocate cheap;
+-- codes left out of the rewrite still reach the comparison
+update currency_rate set rate = 0 where code = 'NZD';
+select count(*) from listings where price < '20 usd';
+update currency_rate set rate = 3 where code = 'NZD';
+insert into currency_rate (code, minor, rate) values ('XTS', 2, 1);
+insert into listings values ('1 xts');
+delete from currency_rate where code = 'XTS';
+select count(*) from listings where price > '20 usd';
+delete from listings where code(price) = 'XTS';
+drop table listings;
+
+-- repeated comparisons of the same values
+select array_agg(x order by x) from (values ('10 usd'::currency), ('30 eur'), ('10 usd'), ('50 nzd'), ('30 eur'), ('45 btc')) v(x);
+select count(*) from (select x from (values ('10 usd'::currency), ('30 eur'), ('10 usd'), ('50 nzd'), ('30 eur'), ('40 btc')) v(x) group by x) g;
+
+-- streaming loader
+\set loadfile :abs_builddir '/results/currency_load.data'
+copy (values (E'Butter Chicken\t10.00nzd'), (E'Korma\t -12.5 EUR '), (E'Vindaloo\t10.00'), ('no tab here'), (E'Madras\t1x.00usd'), (E'Lavabdar\t7usd')) to :'loadfile' with (format csv);
+select lineno, amount, error from currency_load(:'loadfile');
+select description from currency_load(:'loadfile') where lineno = 2;
+-- strict mode stops at the first bad line; the message names the file
+create temp table load_file as select :'loadfile'::text as path;
+do $$
+begin
+	perform count(*) from currency_load((select path from load_file), true);
+exception when others then
+	raise notice '%', replace(sqlerrm, (select path from load_file), 'currency_load.data');
+end
+$$;
+select count(*) from currency_load('/nonexistent/amounts.data');
+
+-- canonical forms
+select '+100.000eur'::currency(strip) as "100 EUR";
+select '-0.50 nzd'::currency(strip) as "-0.5 NZD";
+select '100eur'::currency(minor) as "100.00 EUR";
+select '1234.5 jpy'::currency(minor) as "1235 JPY";
+create table prices (a currency(strip), b currency(minor));
+insert into prices values ('10.500 eur', '10.5 eur'), ('10.5 eur', '10.500 eur');
+select a, b, a::text = '10.5 EUR' as t from prices;
+drop table prices;
+select '1.250 usd'::currency + '2.750 usd'::currency as "4.000 USD";
+select ('1.250 usd'::currency + '2.750 usd'::currency)::currency(strip) as "4 USD";
+
+-- approximate aggregates
+select approx_percentile(x, 0.5) as "202.00 BTC" from (select (g || ' usd')::currency from generate_series(1, 100) g) v(x);
+select approx_percentile(x, 0.5) as "150.00 BTC" from (values ('10 usd'::currency), ('30 eur'), ('50 nzd')) v(x);
+select value(approx_percentile((g || ' usd')::currency, 0.5)) between 39000 and 41000 as t from generate_series(1, 20000) g;
+select n, approx_percentile(x, 0.5) over (order by n) from (values (1, '10 usd'::currency), (2, '20 usd'), (3, '30 usd')) v(n, x);
+select approx_percentile(x, f) from (values ('10 usd'::currency, 0.5), ('20 usd', 0.9)) v(x, f);
+select approx_count_distinct((g || ' usd')::currency) between 970 and 1030 as t from generate_series(1, 1000) g;
+select approx_count_distinct(x) from (values ('10 usd'::currency), ('40 btc'), ('10.00 usd'), ('30 eur')) v(x);
+
+-- vector conversion at exact rational rates
+select '{30000000000000000.00,1.00,-1.00} usd'::currency_vector -> 'eur' as "{20000000000000000.00,0.67,-0.67} EUR";
+
+-- running totals in PL/pgSQL
+create function currency_loop_total(n int, out total currency, out expanded_at_start bool, out expanded_at_end bool) language plpgsql as $$
+begin
+	total := currency_accumulator('0 usd');
+	expanded_at_start := currency_is_expanded(total);
+	for i in 1..n loop
+		total := total + '1.25 usd'::currency;
+		total := total - '0.25 usd'::currency;
+	end loop;
+	expanded_at_end := currency_is_expanded(total);
+end
+$$;
+-- the total only stays expanded where "+" updates it in place
+select total, expanded_at_start, expanded_at_end = (current_setting('server_version_num')::int >= 180000) as in_place_from_pg18 from currency_loop_total(1000);
+select '1 usd'::currency + currency_accumulator('2 usd') as "3 USD";
+drop function currency_loop_total(int);
+
+-- checking a rate feed file
+\set feed :abs_builddir '/results/rate_feed.data'
+copy (values (E'EUR\t978\t2\tEuro\t6.0125'), ('# comment'), (E'nzd\t3.1'), (E'XX\t1'), ('no tab here'), (E'usd\t0'), (E'usd\t-4'), (E'usd\t1e'), (E'usd\t--1'), (E'usd\tNaN'), (E'NZD\t3.2')) to :'feed' with (format csv);
+-- the bad lines are skipped, with warnings naming the file; the last
+-- of the repeated NZD lines wins
+set client_min_messages = error;
+select * from currency_rate_feed_parse(:'feed');
+reset client_min_messages;
+select * from currency_rate_feed_parse('/nonexistent/rates.tsv');
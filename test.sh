@@ -1,7 +1,7 @@
 #!/bin/sh
 
 tmpdir=${tmpdir-`pwd`/tmp}
-pgbin=/usr/lib/postgresql/9.0/bin
+pgbin=${pgbin-`pg_config --bindir`}
 
 make USE_PGXS=0 || exit 1
 
@@ -16,8 +16,6 @@ cat <<EOF >> $tmpdir/postgresql.conf
 listen_addresses=''
 fsync=no
 shared_preload_libraries='\$libdir/auto_explain.so'
-
-custom_variable_classes = 'auto_explain'
 auto_explain.log_min_duration = '3s'
 EOF
 
@@ -54,9 +52,11 @@ case $1 in
 
     *)
 	[ -z "$debug" ] && uninstall=uninstall
+	# files the tests write for the server to read back
+	mkdir -p results
         for test in setup tla currency $uninstall
         do
-            $pgbin/psql -a postgres < sql/$test.sql > expected/$test.testout 2>&1
+            $pgbin/psql -v abs_builddir="`pwd`" -a postgres < sql/$test.sql > expected/$test.testout 2>&1
             diff -F '^-- ' -u expected/$test.out expected/$test.testout && echo PASS: $test "($(wc -l expected/$test.out|cut -f1 -d\ ) lines)"
         done
         ;;
@@ -29,7 +29,7 @@ static char tla_alphabet[] = "0ABCDEFGHIJKLMNOPQRSTUVWXYZ12345";
  * are not currently accepted on input but output as [0-5]
  */
 
-inline void emit_tla_buf(int32 tla, char* result) {
+void emit_tla_buf(int32 tla, char* result) {
 	result[3] = '\0';
 	result[2] = tla_alphabet[tla & 0x1f];
 	result[1] = tla_alphabet[(tla & (0x1f << 5)) >> 5];
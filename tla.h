@@ -14,6 +14,6 @@ Datum		tla_out_text(PG_FUNCTION_ARGS);
 
 int32 parse_tla(char* str);
 
-inline void emit_tla_buf(int32 tla, char* result);
+void emit_tla_buf(int32 tla, char* result);
 
 char* emit_tla(int32 tla);
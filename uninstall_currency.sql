@@ -3,7 +3,10 @@
 -- Adjust this setting to control where the objects get dropped.
 SET search_path = public;
 
+DROP TYPE currency_vector CASCADE;
 DROP TYPE currency CASCADE;
+DROP FUNCTION currency_typmod_in(cstring[]);
+DROP FUNCTION currency_typmod_out(int4);
 
 DROP OPERATOR CLASS tla_ops USING btree CASCADE;
 DROP OPERATOR CLASS tla_ops USING hash CASCADE;
@@ -27,6 +30,18 @@ DROP FUNCTION gt(tla, tla);
 
 DROP FUNCTION btcmp_tla(tla, tla);
 DROP FUNCTION hash_tla(tla);
+DROP FUNCTION hash_tla_extended(tla, int8);
 
 DROP TYPE tla CASCADE;
 
+DROP FUNCTION currency_cmp_support(internal);
+DROP FUNCTION currency_support(internal);
+DROP FUNCTION currency_rate_changed() CASCADE;
+
+DROP FUNCTION approx_percentile_combine(internal, internal);
+DROP FUNCTION approx_percentile_serial(internal);
+DROP FUNCTION approx_percentile_deserial(bytea, internal);
+DROP FUNCTION approx_count_distinct_combine(internal, internal);
+DROP FUNCTION approx_count_distinct_serial(internal);
+DROP FUNCTION approx_count_distinct_deserial(bytea, internal);
+DROP FUNCTION approx_count_distinct_final(internal);